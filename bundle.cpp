@@ -0,0 +1,257 @@
+#define _CRT_SECURE_NO_DEPRECATE
+#include "bundle.h"
+#include "util.h"
+#include "str.h"
+#include "graphics.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// ---- file format
+
+namespace {
+    enum EntryKind {
+        EK_FILE     = 0,    // file contents as-is
+        EK_XORED    = 1,    // contents of xored file, already decoded
+        EK_PIXELS   = 2,    // decoded .gra item: U16 w, U16 h, then w*h pixels
+    };
+
+    struct BundleHeader {
+        char magic[4];      // "V1BN"
+        U32 version;
+        U32 count;          // number of index entries
+        U32 index_offs;     // index is stored after the data
+    };
+
+    struct BundleEntry {
+        char name[52];      // normalized path, ":ITEM" appended for pixels
+        U32 offs, size;
+        U32 kind;
+    };
+
+    static const char BUNDLE_MAGIC[4] = { 'V', '1', 'B', 'N' };
+    static const U32 BUNDLE_VERSION = 2; // 2: index is aligned
+    static const U32 BUNDLE_ALIGN = 16;
+}
+
+// ---- runtime
+
+static Slice s_bundle;
+static const BundleEntry *s_index;
+static U32 s_count;
+
+static bool entry_less(const BundleEntry &a, const BundleEntry &b)
+{
+    return strcmp(a.name, b.name) < 0;
+}
+
+// everything find_entry relies on: terminated names in sorted order, known
+// kinds, and data that lies before the index
+static bool index_valid(const BundleEntry *index, U32 count, U32 data_end)
+{
+    for (U32 i=0; i < count; i++) {
+        const BundleEntry &e = index[i];
+        if (!memchr(e.name, 0, sizeof(e.name)) || e.kind > EK_PIXELS)
+            return false;
+        if (e.offs > data_end || e.size > data_end - e.offs)
+            return false;
+        if (i > 0 && !entry_less(index[i-1], e))
+            return false;
+    }
+    return true;
+}
+
+bool bundle_open(const Str &filename)
+{
+    bundle_close();
+
+    Slice s = try_read_file(filename); // gets mapped unless it's tiny
+    if (!s)
+        return false;
+
+    BundleHeader hdr;
+    if (s.len() < sizeof(hdr))
+        return false;
+    memcpy(&hdr, &s[0], sizeof(hdr));
+
+    if (memcmp(hdr.magic, BUNDLE_MAGIC, 4) != 0 || hdr.version != BUNDLE_VERSION ||
+        hdr.index_offs > s.len() || hdr.index_offs % sizeof(U32) != 0 ||
+        hdr.count > (s.len() - hdr.index_offs) / sizeof(BundleEntry) ||
+        !index_valid((const BundleEntry *)&s[hdr.index_offs], hdr.count, hdr.index_offs)) {
+        printf("%s: not a valid bundle, ignoring it\n", filename.c_str());
+        return false;
+    }
+
+    s_bundle = s;
+    s_index = (const BundleEntry *)&s_bundle[hdr.index_offs];
+    s_count = hdr.count;
+    return true;
+}
+
+void bundle_close()
+{
+    s_bundle = Slice();
+    s_index = 0;
+    s_count = 0;
+}
+
+static Slice find_entry(const Str &name, EntryKind kind)
+{
+    if (!s_count || name.size() >= (int) ARRAY_COUNT(s_index->name))
+        return Slice();
+
+    BundleEntry key;
+    strcpy(key.name, name.c_str());
+
+    const BundleEntry *e = std::lower_bound(s_index, s_index + s_count, key, entry_less);
+    if (e == s_index + s_count || strcmp(e->name, key.name) != 0 || e->kind != (U32)kind)
+        return Slice();
+
+    return s_bundle(e->offs, e->offs + e->size);
+}
+
+Slice bundle_find_file(const Str &filename)
+{
+    return find_entry(normalize_path(filename), EK_FILE);
+}
+
+Slice bundle_find_xored(const Str &filename)
+{
+    return find_entry(normalize_path(filename), EK_XORED);
+}
+
+PixelSlice bundle_find_pixels(const Str &grafilename, const Str &itemname)
+{
+    Slice s = find_entry(normalize_path(grafilename) + ":" + itemname, EK_PIXELS);
+    if (s.len() < 4)
+        return PixelSlice();
+
+    int w = little_u16(&s[0]);
+    int h = little_u16(&s[2]);
+    if ((U32) (w*h) > s.len() - 4)
+        return PixelSlice();
+    return PixelSlice::wrap(s(4), w, h);
+}
+
+// ---- building
+
+namespace {
+    class BundleWriter {
+        FILE *f;
+        U32 pos;
+        std::vector<BundleEntry> index;
+
+        void write(const void *data, U32 size)
+        {
+            fwrite(data, size, 1, f);
+            pos += size;
+        }
+
+    public:
+        BundleWriter(const Str &outname)
+            : pos(0)
+        {
+            f = fopen(outname.c_str(), "wb");
+            if (!f)
+                panic("couldn't open %s for writing", outname.c_str());
+
+            BundleHeader hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            write(&hdr, sizeof(hdr)); // placeholder
+        }
+
+        void align()
+        {
+            static const U8 zeros[BUNDLE_ALIGN] = { 0 };
+            write(zeros, (BUNDLE_ALIGN - pos % BUNDLE_ALIGN) % BUNDLE_ALIGN);
+        }
+
+        void add(const Str &name, EntryKind kind, const void *data, U32 size)
+        {
+            if (name.size() >= (int) ARRAY_COUNT(index[0].name))
+                panic("bundle: name too long: %s", name.c_str());
+
+            align();
+
+            BundleEntry e;
+            memset(&e, 0, sizeof(e));
+            strcpy(e.name, name.c_str());
+            e.offs = pos;
+            e.size = size;
+            e.kind = kind;
+            index.push_back(e);
+
+            write(data, size);
+        }
+
+        void finish()
+        {
+            std::sort(index.begin(), index.end(), entry_less);
+            for (size_t i=1; i < index.size(); i++)
+                if (strcmp(index[i-1].name, index[i].name) == 0)
+                    panic("bundle: %s listed twice", index[i].name);
+
+            align(); // the index gets read in place
+            BundleHeader hdr;
+            memcpy(hdr.magic, BUNDLE_MAGIC, 4);
+            hdr.version = BUNDLE_VERSION;
+            hdr.count = (U32) index.size();
+            hdr.index_offs = pos;
+            if (!index.empty())
+                write(&index[0], (U32) (index.size() * sizeof(BundleEntry)));
+
+            fseek(f, 0, SEEK_SET);
+            fwrite(&hdr, sizeof(hdr), 1, f);
+            fclose(f);
+            f = 0;
+        }
+    };
+}
+
+static void add_gra_pixels(BundleWriter &out, const Str &name, const Slice &data)
+{
+    GraArchive gra(data, name);
+    for (auto it = gra.begin(); it != gra.end(); ++it) {
+        const PixelSlice p = load_gra_item(gra, &*it);
+        if (!p)
+            continue;
+
+        // write tightly packed rows
+        int w = p.width(), h = p.height();
+        std::vector<U8> pixels(4 + w*h);
+        pixels[0] = w & 0xff; pixels[1] = w >> 8;
+        pixels[2] = h & 0xff; pixels[3] = h >> 8;
+        for (int y=0; y < h; y++)
+            memcpy(&pixels[4 + y*w], p.row(y), w);
+
+        out.add(name + ":" + it->name, EK_PIXELS, &pixels[0], (U32) pixels.size());
+    }
+}
+
+void bundle_build(const Str &outname, const Str &listname, bool decode_pixels)
+{
+    bundle_close(); // always build from the loose files
+
+    BundleWriter out(outname);
+    Slice list = read_file(listname);
+    int nfiles = 0;
+
+    while (list.len()) {
+        Str filename = to_string(chop_line(list));
+        if (filename.empty() || filename[0] == ';')
+            continue;
+
+        Str name = normalize_path(filename);
+        Slice data = is_xored_file(filename) ? read_xored(filename) : read_file(filename);
+        out.add(name, is_xored_file(filename) ? EK_XORED : EK_FILE, data.len() ? &data[0] : 0, data.len());
+
+        if (decode_pixels && has_suffixi(filename, ".gra"))
+            add_gra_pixels(out, name, data);
+
+        nfiles++;
+    }
+
+    out.finish();
+    printf("bundle: wrote %d files to %s\n", nfiles, outname.c_str());
+}
@@ -0,0 +1,24 @@
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+#include "common.h"
+
+class Slice;
+class PixelSlice;
+class Str;
+
+// Asset bundle: a single mappable file holding copies of the game data in
+// load order, with xored files stored already decoded and (optionally) .gra
+// items stored as raw pixels. read_file/read_xored/load_gra_item look here
+// first when a bundle is open.
+bool bundle_open(const Str &filename);
+void bundle_close();
+
+Slice bundle_find_file(const Str &filename);
+Slice bundle_find_xored(const Str &filename);
+PixelSlice bundle_find_pixels(const Str &grafilename, const Str &itemname);
+
+// listname has one file per line, in the order they should be laid out
+void bundle_build(const Str &outname, const Str &listname, bool decode_pixels);
+
+#endif
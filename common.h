@@ -10,6 +10,7 @@ typedef unsigned int    U32;
 typedef signed char     S8;
 typedef signed short    S16;
 typedef signed int      S32;
+typedef unsigned long long U64;
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
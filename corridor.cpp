@@ -6,6 +6,7 @@
 #include "vars.h"
 #include "mouse.h"
 #include "script.h"
+#include "diskcache.h"
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -243,7 +244,7 @@ static Sector sector_from_pos(const Pos &p)
 struct ObjectDesc {
     Slice script;
     Str gfx_name;
-    PixelSlice gfx_lr[2], gfx_m;
+    Sprite gfx_lr[2], gfx_m;
     U8 x, y, flipX;
 	char cursor;
 };
@@ -263,7 +264,7 @@ static void load_dsc()
         //   U8 cursorType, imgType;
         Slice header = chop(dsc, 17);
         Str name = to_string(chop_until(dsc, '\r'));
-        Slice script = chop_until(dsc, 0);
+        Slice script = chop_until(dsc, 0).clone(); // file data is shared, don't modify in place
 
 		// fix up script
 		for (U32 i=0; i < script.len(); i++)
@@ -284,21 +285,13 @@ static void load_dsc()
     }
 }
 
-static PixelSlice load_dsc_slice(const Slice &objlib, const Str &name)
+static Sprite load_dsc_slice(const GraArchive &objlib, const Str &name)
 {
-    U8 type;
-    int offs = find_gra_item(objlib, name, &type);
-    if (offs >= 0) {
-        if (type == 5)
-            return load_delta_pixels(objlib(offs));
-        else if (type == 8)
-            return load_rle_with_header(objlib(offs));
-    }
-
-    return PixelSlice();
+    const GraArchive::Item *item = objlib.find(name);
+    return item ? load_gra_sprite(objlib, item) : Sprite();
 }
 
-static void load_dsc_gfx(const Slice &objlib)
+static void load_dsc_gfx(const GraArchive &objlib)
 {
     for (auto it = s_objtab.begin(); it != s_objtab.end(); ++it) {
         const Str &name = it->gfx_name;
@@ -317,30 +310,29 @@ class CorridorGfx {
     static const int DEPTH = 6;
 
     // building blocks
-    PixelSlice wall_side[DEPTH];
-    PixelSlice wall_ahead[DEPTH];
-    PixelSlice door_side[DEPTH];
-    PixelSlice door_ahead[DEPTH];
-    PixelSlice door_inturn[DEPTH];
-    PixelSlice corner[DEPTH];
-    PixelSlice fork[DEPTH];
-    PixelSlice cover[DEPTH];
-    PixelSlice empty;
+    Sprite wall_side[DEPTH];
+    Sprite wall_ahead[DEPTH];
+    Sprite door_side[DEPTH];
+    Sprite door_ahead[DEPTH];
+    Sprite door_inturn[DEPTH];
+    Sprite corner[DEPTH];
+    Sprite fork[DEPTH];
+    Sprite cover[DEPTH];
+
+    U8 sector_colors[4][256]; // wall color remap, by Sector
 
 	Slice hot_script[3];
 
-    static PixelSlice load(const Slice &lib, const char *basename, int idx)
+    static PixelSlice load(const GraArchive &lib, const char *basename, int idx)
     {
-        U8 type;
-        int offs = find_gra_item(lib, Str::fmt("%s%d", basename, idx), &type);
-        if (offs < 0 || type != 5)
+        const GraArchive::Item *item = lib.find(Str::fmt("%s%d", basename, idx));
+        if (!item || item->type != 5)
             panic("bad graphics for corridor!");
-        return load_delta_pixels(lib(offs));
+        return load_gra_item(lib, item);
     }
 
-    static void blit_chunk(const PixelSlice &what, bool flipx, Sector sec)
+    void init_sector_colors()
     {
-        static const int CX = 160, CY = 32;
         static const int nremap = 2;
         static const U8 remap_src[nremap] = { 0x02, 0x7f };
         static const U8 remap_dst[4][nremap] = {
@@ -350,23 +342,72 @@ class CorridorGfx {
             { 0x5e, 0x58 },
         };
 
-        blit_transparent_shrink(vga_screen, CX, CY, what.replace_colors(remap_src, remap_dst[sec], nremap), 1, flipx);
+        for (int sec=0; sec < 4; sec++) {
+            for (int i=0; i < 256; i++)
+                sector_colors[sec][i] = i;
+            for (int i=0; i < nremap; i++)
+                sector_colors[sec][remap_src[i]] = remap_dst[sec][i];
+        }
+    }
+
+    void blit_chunk(const Sprite &what, bool flipx, Sector sec)
+    {
+        static const int CX = 160, CY = 32;
+        what.blit_remapped(vga_screen, CX, CY, sector_colors[sec], 1, flipx);
+    }
+
+    static const int NPIECES = 8;
+
+    void get_pieces(Sprite *pieces[NPIECES])
+    {
+        pieces[0] = wall_side;
+        pieces[1] = wall_ahead;
+        pieces[2] = door_side;
+        pieces[3] = door_ahead;
+        pieces[4] = door_inturn;
+        pieces[5] = corner;
+        pieces[6] = fork;
+        pieces[7] = cover;
+    }
+
+    // images for all pieces, in get_pieces order
+    static void decode(const GraArchive &lib, std::vector<PixelSlice> *images)
+    {
+        PixelSlice img[NPIECES][DEPTH];
+        for (int i=0; i < DEPTH; i++) {
+            img[0][i] = load(lib, "WAND", i);
+            img[1][i] = load(lib, "FRONTAL", i);
+            img[2][i] = (i >= 1 && i <= 4) ? load(lib, "TUER", i) : img[0][i];
+            img[3][i] = load(lib, "FTUER", i);
+            img[4][i] = (i >= 0 && i <= 4) ? load(lib, "GTUER", i) : PixelSlice();
+            img[5][i] = load(lib, "ECKE", i);
+            img[6][i] = load(lib, "GANG", i);
+            img[7][i] = (i >= 2) ? load(lib, "ABDECK", i) : PixelSlice();
+        }
+
+        images->clear();
+        for (int i=0; i < NPIECES*DEPTH; i++)
+            images->push_back(img[i / DEPTH][i % DEPTH]);
     }
 
 public:
     void init(const Str &libfilename)
     {
-        Slice lib = read_file(libfilename);
-        for (int i=0; i < DEPTH; i++) {
-            wall_side[i] = load(lib, "WAND", i);
-            wall_ahead[i] = load(lib, "FRONTAL", i);
-            door_side[i] = (i >= 1 && i <= 4) ? load(lib, "TUER", i) : wall_side[i];
-            door_ahead[i] = load(lib, "FTUER", i);
-            door_inturn[i] = (i >= 0 && i <= 4) ? load(lib, "GTUER", i) : PixelSlice();
-            corner[i] = load(lib, "ECKE", i);
-            fork[i] = load(lib, "GANG", i);
-            cover[i] = (i >= 2) ? load(lib, "ABDECK", i) : PixelSlice();
+        Sprite *pieces[NPIECES];
+        get_pieces(pieces);
+
+        // decoded pieces are kept in the disk cache between runs
+        Slice src = read_file(libfilename);
+        std::vector<PixelSlice> images;
+        if (!diskcache_load("corridor", libfilename, src, &images) || images.size() != NPIECES*DEPTH) {
+            decode(*read_gra(libfilename), &images);
+            diskcache_store("corridor", libfilename, src, images);
         }
+
+        for (int i=0; i < NPIECES*DEPTH; i++)
+            pieces[i / DEPTH][i % DEPTH] = Sprite(images[i]);
+
+        init_sector_colors();
     }
 
     void render(Pos pos, Dir look_dir)
@@ -439,14 +480,14 @@ public:
                         static const int ytab[3] = { 0, 30, 45 };
                         const ObjectDesc &obj = s_objtab[objtype - 1];
 
-						const PixelSlice &gfx = obj.gfx_lr[lr ^ obj.flipX];
+						const Sprite &gfx = obj.gfx_lr[lr ^ obj.flipX];
 						int x = 160 - flipx;
 						int y = ytab[revz];
 
-                        blit_transparent_shrink(clipscreen, x, y, gfx, 1 << revz, flipx);
+                        gfx.blit(clipscreen, x, y, 1 << revz, flipx);
 						if (revz == 0) {
 							int hotidx = flipx ? 7 : 5;
-							blit_to_mask(hotspots, hotidx, x, y, gfx, flipx);
+							gfx.blit_mask(hotspots, hotidx, x, y, flipx);
 							game_hotspot_define(hotidx, obj.cursor);
 							hot_script[hotidx - 5] = obj.script;
 						}
@@ -467,9 +508,9 @@ public:
                 int y = ytab[obj.y != 0][revz] + (obj.y >> revz);
                 x = obj.flipX ? 159 + x : 160 - x;
 
-                blit_transparent_shrink(clipscreen, x, y, obj.gfx_m, 1 << revz, obj.flipX != 0);
+                obj.gfx_m.blit(clipscreen, x, y, 1 << revz, obj.flipX != 0);
 				if (revz == 0) {
-					blit_to_mask(hotspots, 6, x, y, obj.gfx_m, obj.flipX != 0);
+					obj.gfx_m.blit_mask(hotspots, 6, x, y, obj.flipX != 0);
 					game_hotspot_define(6, obj.cursor);
 					hot_script[1] = obj.script;
 				}
@@ -513,14 +554,19 @@ void corridor_start()
     int level = get_var_int("etage");
 
     solid_fill(vga_screen, 0);
-    load_level(level);
 
     const char *libname = "grafix/gmod02.gra";
     if (level >= 10 && level <= 42)
         libname = "grafix/gmod01.gra";
 
-    Slice objlib = read_file(libname);
-    load_dsc_gfx(objlib);
+    // issue both reads at once; the loads below then hit the cache
+    std::vector<Str> files;
+    files.push_back("data/levels.dat");
+    files.push_back(libname);
+    read_files_batch(files);
+
+    load_level(level);
+    load_dsc_gfx(*read_gra(libname));
 
     // determine which palette to load
     int pal = map2[0][21]; // magic index from the game.
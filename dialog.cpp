@@ -327,7 +327,7 @@ static void display_face(const char *charname, bool flipped, int scale)
     } else if (flipped)
         x = 319;
 
-    blit_transparent_shrink(vga_screen, x, y, load_delta_pixels(s(sizeof(Palette))), scale, flipped);
+    blit_delta_transparent(vga_screen, x, y, s(sizeof(Palette)), scale, flipped);
     set_palette();
 }
 
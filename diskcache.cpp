@@ -0,0 +1,287 @@
+#define _CRT_SECURE_NO_DEPRECATE
+#include "diskcache.h"
+#include "util.h"
+#include "str.h"
+#include "graphics.h"
+#include "bundle.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// ---- file format
+
+namespace {
+    struct CacheHeader {
+        char magic[4];      // "V1DC"
+        U32 version;
+        U32 src_size;
+        U32 src_hash_lo, src_hash_hi;
+        U32 count;          // number of images, CacheImage[count] follows
+    };
+
+    struct CacheImage {
+        U16 w, h;
+        U32 offs;           // of first row; rows are packed
+    };
+
+    static const char CACHE_MAGIC[4] = { 'V', '1', 'D', 'C' };
+    static const U32 CACHE_VERSION = 2; // bump when a decoder changes its output; 2: new source hash
+    static const U32 CACHE_ALIGN = 16;
+}
+
+static Str s_dir;
+static std::atomic<U32> s_temp_counter;
+
+// unique per writer, so two threads storing the same entry don't share one
+static Str temp_filename(const Str &filename)
+{
+    return Str::fmt("%s.%u.tmp", filename.c_str(), (U32) ++s_temp_counter);
+}
+
+// ---- source hashes
+
+namespace {
+    struct SourceStamp {
+        U32 size;
+        U64 mtime;
+        U64 hash;
+    };
+}
+
+static std::mutex s_stamps_mutex;
+static std::unordered_map<Str, SourceStamp> s_stamps; // normalized source name -> stamp
+
+static U64 hash_bytes(const Slice &s)
+{
+    // multiply and fold, a word at a time
+    static const U64 K = 0x9e3779b97f4a7c15ull;
+    U32 n = s.len(), i = 0;
+    const U8 *p = n ? &s[0] : 0;
+    U64 hash = n * K;
+    for (; i + 8 <= n; i += 8) {
+        U64 w;
+        memcpy(&w, p + i, 8);
+        hash = (hash ^ w) * K;
+        hash ^= hash >> 32;
+    }
+    for (; i < n; i++)
+        hash = (hash ^ p[i]) * K;
+    return hash ^ (hash >> 29);
+}
+
+static bool file_stamp(const Str &filename, U32 *size, U64 *mtime)
+{
+    Str path = vfs_resolve(filename);
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0)
+        return false;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#endif
+    *size = (U32) st.st_size;
+    *mtime = (U64) st.st_mtime;
+    return true;
+}
+
+static Str stamps_filename()
+{
+    return s_dir + "/stamps";
+}
+
+static Str stamp_line(const Str &name, const SourceStamp &st)
+{
+    return Str::fmt("%016llx %u %llx ", (unsigned long long) st.hash, st.size, (unsigned long long) st.mtime) + name + "\n";
+}
+
+// New stamps get appended, so a name can show up more than once; the last
+// one wins. Returns the number of lines read.
+static int load_stamps()
+{
+    Slice text = try_read_file_uncached(stamps_filename());
+    int nlines = 0;
+    while (text.len()) {
+        Str line = to_string(chop_line(text));
+        nlines++;
+
+        // an append cut short by a crash runs into the next line
+        if (line.size() < 17 || line[16] != ' ')
+            continue;
+
+        unsigned long long mtime, hash;
+        unsigned size;
+        int namepos;
+        if (sscanf(line.c_str(), "%llx %u %llx %n", &hash, &size, &mtime, &namepos) != 3)
+            continue;
+
+        SourceStamp st = { size, mtime, hash };
+        s_stamps[line.substr(namepos)] = st;
+    }
+    return nlines;
+}
+
+// s_stamps_mutex must be held
+static void append_stamp(const Str &name, const SourceStamp &st)
+{
+    FILE *f = fopen(stamps_filename().c_str(), "ab");
+    if (!f)
+        return;
+
+    Str line = stamp_line(name, st);
+    fwrite(line.c_str(), line.size(), 1, f);
+    fclose(f);
+}
+
+// writes out just the live stamps (s_stamps_mutex must be held)
+static void save_stamps()
+{
+    Str text;
+    for (auto it = s_stamps.begin(); it != s_stamps.end(); ++it)
+        text += stamp_line(it->first, it->second);
+
+    Str filename = stamps_filename();
+    Str tempname = temp_filename(filename);
+    FILE *f = fopen(tempname.c_str(), "wb");
+    if (!f)
+        return;
+
+    bool ok = fwrite(text.c_str(), text.size(), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    remove(filename.c_str());
+    if (!ok || rename(tempname.c_str(), filename.c_str()) != 0)
+        remove(tempname.c_str());
+}
+
+// Hashes source only if srcname's size or modification time changed since
+// the last time. Bundled sources always get hashed: the copy in the bundle
+// needn't match the loose file any more.
+static U64 source_hash(const Str &srcname, const Slice &source)
+{
+    U32 size;
+    U64 mtime;
+    if (bundle_find_file(srcname) || !file_stamp(srcname, &size, &mtime) || size != source.len())
+        return hash_bytes(source);
+
+    Str key = normalize_path(srcname);
+    {
+        std::lock_guard<std::mutex> lock(s_stamps_mutex);
+        auto it = s_stamps.find(key);
+        if (it != s_stamps.end() && it->second.size == size && it->second.mtime == mtime)
+            return it->second.hash;
+    }
+
+    SourceStamp st = { size, mtime, hash_bytes(source) };
+    std::lock_guard<std::mutex> lock(s_stamps_mutex);
+    s_stamps[key] = st;
+    append_stamp(key, st);
+    return st.hash;
+}
+
+// ---- entries
+
+static Str entry_filename(const char *kind, U64 hash)
+{
+    return Str::fmt("%s/%s-%08x%08x.dc", s_dir.c_str(), kind, (U32) (hash >> 32), (U32) hash);
+}
+
+void diskcache_init(const Str &dir)
+{
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+    s_dir = dir;
+
+    // squeeze out the superseded lines once they're the bulk of the file
+    std::lock_guard<std::mutex> lock(s_stamps_mutex);
+    if (load_stamps() > 2 * (int) s_stamps.size() + 64)
+        save_stamps();
+}
+
+bool diskcache_load(const char *kind, const Str &srcname, const Slice &source, std::vector<PixelSlice> *images)
+{
+    if (s_dir.empty())
+        return false;
+
+    U64 hash = source_hash(srcname, source);
+    Slice s = try_read_file_uncached(entry_filename(kind, hash));
+    if (!s || s.len() < sizeof(CacheHeader))
+        return false;
+
+    CacheHeader hdr;
+    memcpy(&hdr, &s[0], sizeof(hdr));
+    if (memcmp(hdr.magic, CACHE_MAGIC, 4) != 0 || hdr.version != CACHE_VERSION ||
+        hdr.src_size != source.len() || hdr.src_hash_lo != (U32) hash || hdr.src_hash_hi != (U32) (hash >> 32) ||
+        hdr.count > (s.len() - sizeof(hdr)) / sizeof(CacheImage))
+        return false;
+
+    std::vector<PixelSlice> result;
+    for (U32 i=0; i < hdr.count; i++) {
+        CacheImage img;
+        memcpy(&img, &s[sizeof(hdr) + i*sizeof(img)], sizeof(img));
+        if (img.offs > s.len() || (U32) img.w * img.h > s.len() - img.offs)
+            return false; // truncated
+
+        result.push_back(PixelSlice::wrap(s(img.offs), img.w, img.h));
+    }
+
+    images->swap(result);
+    return true;
+}
+
+void diskcache_store(const char *kind, const Str &srcname, const Slice &source, const std::vector<PixelSlice> &images)
+{
+    if (s_dir.empty())
+        return;
+
+    U64 hash = source_hash(srcname, source);
+    CacheHeader hdr;
+    memcpy(hdr.magic, CACHE_MAGIC, 4);
+    hdr.version = CACHE_VERSION;
+    hdr.src_size = source.len();
+    hdr.src_hash_lo = (U32) hash;
+    hdr.src_hash_hi = (U32) (hash >> 32);
+    hdr.count = (U32) images.size();
+
+    // lay out the pixel data
+    std::vector<CacheImage> dir(images.size());
+    U32 pos = sizeof(hdr) + (U32) (images.size() * sizeof(CacheImage));
+    for (size_t i=0; i < images.size(); i++) {
+        pos = (pos + CACHE_ALIGN-1) & ~(CACHE_ALIGN-1);
+        dir[i].w = images[i].width();
+        dir[i].h = images[i].height();
+        dir[i].offs = pos;
+        pos += dir[i].w * dir[i].h;
+    }
+
+    std::vector<U8> out(pos, 0);
+    memcpy(&out[0], &hdr, sizeof(hdr));
+    if (!dir.empty())
+        memcpy(&out[sizeof(hdr)], &dir[0], dir.size() * sizeof(CacheImage));
+    for (size_t i=0; i < images.size(); i++)
+        for (int y=0; y < dir[i].h; y++)
+            memcpy(&out[dir[i].offs + y*dir[i].w], images[i].row(y), dir[i].w);
+
+    // write to a temp file first so a crash never leaves a half-written entry
+    Str filename = entry_filename(kind, hash);
+    Str tempname = temp_filename(filename);
+    FILE *f = fopen(tempname.c_str(), "wb");
+    if (!f)
+        return; // cache is best-effort
+
+    bool ok = fwrite(&out[0], out.size(), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    remove(filename.c_str());
+    if (!ok || rename(tempname.c_str(), filename.c_str()) != 0)
+        remove(tempname.c_str());
+}
@@ -0,0 +1,22 @@
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include "common.h"
+#include <vector>
+
+class Slice;
+class PixelSlice;
+class Str;
+
+// Persistent cache of decoded images, kept across runs. Entries are keyed by
+// a hash of the source data (plus a kind tag), so a changed source file simply
+// misses. The hash of a loose source file is remembered along with its size
+// and modification time, so it only gets read through again once it changes.
+// Each entry holds a list of images, stored as raw rows.
+void diskcache_init(const Str &dir); // not calling this disables the cache
+
+// source is the whole of the file srcname, as read_file returns it
+bool diskcache_load(const char *kind, const Str &srcname, const Slice &source, std::vector<PixelSlice> *images);
+void diskcache_store(const char *kind, const Str &srcname, const Slice &source, const std::vector<PixelSlice> &images);
+
+#endif
@@ -2,7 +2,9 @@
 #include "graphics.h"
 #include "util.h"
 #include "str.h"
+#include "diskcache.h"
 #include <algorithm>
+#include <vector>
 #include <string.h>
 #include <assert.h>
 
@@ -97,8 +99,15 @@ private:
 BitmapFont::BitmapFont(const char *filename, const U8 *widths, const U8 *palette)
     : widths(widths)
 {
-    gfx = load_rle_with_header(read_file(filename));
-    gfx = gfx.make_resized(320, gfx.height());
+    Slice src = read_file(filename);
+    std::vector<PixelSlice> cached;
+    if (diskcache_load("font", filename, src, &cached) && cached.size() == 1)
+        gfx = cached[0];
+    else {
+        gfx = load_rle_with_header(src);
+        gfx = gfx.make_resized(320, gfx.height());
+        diskcache_store("font", filename, src, std::vector<PixelSlice>(1, gfx));
+    }
     memcpy(pal, palette, sizeof(pal));
 }
 
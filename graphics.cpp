@@ -2,7 +2,15 @@
 #include "util.h"
 #include "str.h"
 #include "script.h"
+#include "bundle.h"
+#include "diskcache.h"
+#include "jobs.h"
+#include "simd.h"
+#include "pool.h"
 #include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,43 +26,63 @@ Palette palette_a, palette_b;
 
 // ---- pixel slices
 
+static const int ROW_ALIGN = 64; // for make_aligned: a cache line, two AVX2 vectors
 struct PixelBuffer
 {
     U8 *pixels;
-    U32 nrefs;
+    std::atomic<U32> nrefs; // images get decoded on worker threads
+    Slice backing; // set if pixels point into someone else's bytes
+    bool scratch; // block is from the scratch arena
 
-    PixelBuffer(int w, int h)
+    PixelBuffer(U8 *pixels, const Slice &backing, bool scratch)
+        : pixels(pixels), backing(backing), scratch(scratch)
     {
-        assert(w >= 0 && h >= 0);
-        pixels = new U8[w*h];
         nrefs = 0;
-        
-        if (!pixels)
-            panic("out of memory");
     }
 
-    ~PixelBuffer()
+    // the pixels follow the header in the same block, starting at a
+    // multiple of align (a power of two)
+    static PixelBuffer *create(int nbytes, int align, bool scratch)
     {
-        delete[] pixels;
+        assert(nbytes >= 0);
+        U32 size = sizeof(PixelBuffer) + (align - 1) + nbytes;
+        PixelBuffer *b = new(scratch ? scratch_alloc(size) : pool_alloc(size)) PixelBuffer(0, Slice(), scratch);
+        b->pixels = (U8 *) (((size_t) (b + 1) + align - 1) & ~(size_t) (align - 1));
+        return b;
+    }
+
+    static PixelBuffer *create_view(const Slice &bytes)
+    {
+        return new(pool_alloc(sizeof(PixelBuffer))) PixelBuffer((U8 *) &bytes[0], bytes, false);
     }
 
     static void ref(PixelBuffer *x)     { if (x) x->nrefs++; }
-    static void unref(PixelBuffer *x)   { if (x && --x->nrefs == 0) delete x; }
+    static void unref(PixelBuffer *x)
+    {
+        if (x && --x->nrefs == 0) {
+            bool scratch = x->scratch;
+            x->~PixelBuffer();
+            if (scratch)
+                scratch_free(x);
+            else
+                pool_free(x);
+        }
+    }
 };
 
 PixelSlice::PixelSlice()
-    : buf(0), pixels(0), w(0), h(0), stride(0)
+    : buf(0), pixels(0), w(0), h(0), stride(0), readonly(false)
 {
 }
 
-PixelSlice::PixelSlice(PixelBuffer *buf, int w, int h)
-    : buf(buf), pixels(buf->pixels), w(w), h(h), stride(w)
+PixelSlice::PixelSlice(PixelBuffer *buf, int w, int h, int stride)
+    : buf(buf), pixels(buf->pixels), w(w), h(h), stride(stride), readonly(false)
 {
     PixelBuffer::ref(buf);
 }
 
 PixelSlice::PixelSlice(const PixelSlice &x)
-    : buf(x.buf), pixels(x.pixels), w(x.w), h(x.h), stride(x.stride)
+    : buf(x.buf), pixels(x.pixels), w(x.w), h(x.h), stride(x.stride), readonly(x.readonly)
 {
     PixelBuffer::ref(buf);
 }
@@ -66,7 +94,21 @@ PixelSlice::~PixelSlice()
 
 PixelSlice PixelSlice::make(int w, int h)
 {
-    return PixelSlice(new PixelBuffer(w, h), w, h);
+    assert(w >= 0 && h >= 0);
+    return PixelSlice(PixelBuffer::create(w*h, 1, false), w, h, w);
+}
+
+PixelSlice PixelSlice::make_aligned(int w, int h)
+{
+    assert(w >= 0 && h >= 0);
+    int stride = (w + ROW_ALIGN-1) & ~(ROW_ALIGN-1);
+    return PixelSlice(PixelBuffer::create(stride*h, ROW_ALIGN, false), w, h, stride);
+}
+
+PixelSlice PixelSlice::make_scratch(int w, int h)
+{
+    assert(w >= 0 && h >= 0);
+    return PixelSlice(PixelBuffer::create(w*h, 1, true), w, h, w);
 }
 
 PixelSlice PixelSlice::black(int w, int h)
@@ -76,6 +118,19 @@ PixelSlice PixelSlice::black(int w, int h)
     return p;
 }
 
+PixelSlice PixelSlice::wrap(const Slice &bytes, int w, int h)
+{
+    assert(w >= 0 && h >= 0);
+    if (!w || !h)
+        return PixelSlice();
+    if ((U32) (w*h) > bytes.len())
+        panic("pixel view out of bounds (%dx%d, %d bytes)", w, h, bytes.len());
+
+    PixelSlice p(PixelBuffer::create_view(bytes), w, h, w);
+    p.readonly = true;
+    return p;
+}
+
 PixelSlice &PixelSlice::operator =(const PixelSlice &x)
 {
     PixelBuffer::ref(x.buf);
@@ -85,23 +140,47 @@ PixelSlice &PixelSlice::operator =(const PixelSlice &x)
     w = x.w;
     h = x.h;
     stride = x.stride;
+    readonly = x.readonly;
     return *this;
 }
 
-const PixelSlice PixelSlice::slice(int x0, int y0, int x1, int y1) const
+PixelSlice &PixelSlice::operator =(PixelSlice &&x)
 {
-    if (x1 < x0 || y1 < y0)
-        return PixelSlice();
+    if (this != &x) {
+        PixelBuffer::unref(buf);
+        move_from(x);
+    }
+    return *this;
+}
+
+void PixelSlice::narrow(int x0, int y0, int x1, int y1)
+{
+    if (x1 < x0 || y1 < y0) {
+        *this = PixelSlice();
+        return;
+    }
 
     x0 = std::min(x0, w);
     x1 = std::min(x1, w);
     y0 = std::min(y0, h);
     y1 = std::min(y1, h);
 
+    pixels += y0 * stride + x0;
+    w = x1 - x0;
+    h = y1 - y0;
+}
+
+const PixelSlice PixelSlice::slice(int x0, int y0, int x1, int y1) const
+{
+    PixelSlice s(*this);
+    s.narrow(x0, y0, x1, y1);
+    return s;
+}
+
+PixelSlice PixelSlice::slice(int x0, int y0, int x1, int y1)
+{
     PixelSlice s(*this);
-    s.pixels += y0 * s.stride + x0;
-    s.w = x1 - x0;
-    s.h = y1 - y0;
+    s.narrow(x0, y0, x1, y1);
     return s;
 }
 
@@ -112,6 +191,19 @@ PixelSlice PixelSlice::clone() const
     return s;
 }
 
+// Pointers from this slice's const accessors may be left dangling; copies
+// of the view keep the old pixels.
+void PixelSlice::make_writable()
+{
+    if (readonly)
+        *this = clone();
+}
+
+void PixelSlice::write_denied() const
+{
+    panic("write to a read-only pixel view (%dx%d)", w, h);
+}
+
 PixelSlice PixelSlice::reinterpret(int neww, int newh)
 {
     assert(w == stride);
@@ -124,6 +216,35 @@ PixelSlice PixelSlice::reinterpret(int neww, int newh)
     return s;
 }
 
+PixelSlice crop_to_opaque(const PixelSlice &img, int *x0, int *y0)
+{
+    int minx = img.width(), maxx = -1;
+    int miny = img.height(), maxy = -1;
+    for (int y=0; y < img.height(); y++) {
+        const U8 *row = img.row(y);
+        int x = 0, last = img.width() - 1;
+        while (x <= last && !row[x])
+            x++;
+        if (x > last)
+            continue;
+        while (!row[last])
+            last--;
+
+        minx = std::min(minx, x);
+        maxx = std::max(maxx, last);
+        miny = std::min(miny, y);
+        maxy = y;
+    }
+
+    *x0 = *y0 = 0;
+    if (maxy < 0)
+        return PixelSlice();
+
+    *x0 = minx;
+    *y0 = miny;
+    return img.slice(minx, miny, maxx + 1, maxy + 1).clone();
+}
+
 PixelSlice PixelSlice::make_resized(int neww, int newh) const
 {
     PixelSlice s = black(neww, newh);
@@ -133,20 +254,9 @@ PixelSlice PixelSlice::make_resized(int neww, int newh) const
 
 PixelSlice PixelSlice::replace_colors(const U8 *from_col, const U8 *to_col, int ncols) const
 {
-    U8 map[256];
-    for (int i=0; i < 256; i++)
-        map[i] = i;
-
-    for (int i=0; i < ncols; i++)
-        map[from_col[i]] = to_col[i];
-
     PixelSlice s = make(w, h);
-    for (int y=0; y < h; y++) {
-        const U8 *srcp = row(y);
-        U8 *dstp = s.row(y);
-        for (int x=0; x < w; x++)
-            dstp[x] = map[srcp[x]];
-    }
+    for (int y=0; y < h; y++)
+        replace_colors_row(s.row(y), row(y), w, from_col, to_col, ncols);
 
     return s;
 }
@@ -154,7 +264,7 @@ PixelSlice PixelSlice::replace_colors(const U8 *from_col, const U8 *to_col, int
 void solid_fill(PixelSlice &dest, int color)
 {
     for (int y=0; y < dest.height(); y++)
-        memset(dest.row(y), color, dest.width());
+        fill_bytes(dest.row(y), (U8) color, dest.width());
 }
 
 static bool clipblit(Rect *sr, int dx, int dy, const PixelSlice &dest, const PixelSlice &src, int shrink=1)
@@ -185,15 +295,8 @@ void blit_transparent(PixelSlice &dest, int dx, int dy, const PixelSlice &src)
         return;
 
     int w = sr.x1 - sr.x0;
-    for (int sy=sr.y0; sy < sr.y1; sy++) {
-        U8 *d = dest.ptr(dx+sr.x0, dy+sy);
-        const U8 *s = src.ptr(sr.x0, sy);
-
-        for (int x=0; x < w; x++) {
-            if (s[x])
-                d[x] = s[x];
-        }
-    }
+    for (int sy=sr.y0; sy < sr.y1; sy++)
+        blit_row_transparent(dest.ptr(dx+sr.x0, dy+sy), src.ptr(sr.x0, sy), w, 1);
 }
 
 void blit_transparent_shrink(PixelSlice &dest, int dx, int dy, const PixelSlice &src, int shrink, bool flipX)
@@ -212,15 +315,8 @@ void blit_transparent_shrink(PixelSlice &dest, int dx, int dy, const PixelSlice
         dx--;
     }
 
-    for (int sy=sr.y0; sy < sr.y1; sy += shrink) {
-        U8 *d = dest.ptr(dx + sxstart/stepx, dy + sy/shrink);
-        const U8 *s = src.ptr(sxstart, sy);
-
-        for (int x=0; x < w; x++) {
-            if (s[x*stepx])
-                d[x] = s[x*stepx];
-        }
-    }
+    for (int sy=sr.y0; sy < sr.y1; sy += shrink)
+        blit_row_transparent(dest.ptr(dx + sxstart/stepx, dy + sy/shrink), src.ptr(sxstart, sy), w, stepx);
 }
 
 void blit_to_mask(PixelSlice &dest, U8 color, int dx, int dy, const PixelSlice &src, bool flipX)
@@ -242,82 +338,551 @@ void blit_to_mask(PixelSlice &dest, U8 color, int dx, int dy, const PixelSlice &
 		dx--;
 	}
 
-	for (int sy=sr.y0; sy < sr.y1; sy += 2) {
-		U8 *d = dest.ptr(dx + sxstart/2, dy + sy/2);
-		const U8 *s0 = src.ptr(sxstart, sy + 0);
-		const U8 *s1 = src.ptr(sxstart, sy + 1);
-
-		for (int x=0; x < w; x++) {
-			int xs = x*stepx;
-			U8 ored = s0[xs] | s0[xs + 1] | s1[xs] | s1[xs + 1];
-			if (ored)
-				d[x] = color;
-		}
-	}
+	for (int sy=sr.y0; sy < sr.y1; sy += 2)
+		blit_row_mask(dest.ptr(dx + sxstart/2, dy + sy/2), src.ptr(sxstart, sy), src.ptr(sxstart, sy + 1), w, stepx, color);
+}
+
+static void blit_row_remap(U8 *dst, const U8 *src, int n, int step, const U8 *map)
+{
+    for (int x=0; x < n; x++) {
+        U8 c = src[x*step];
+        if (c)
+            dst[x] = map[c];
+    }
+}
+
+// Draws count source pixels p, starting at x=sx in a srcw wide image, onto
+// the dest row d (dw wide) for a blit at dx. Same mapping as
+// blit_transparent_shrink; flipped images are mirrored about dx. Zero pixels
+// are skipped; opaque says there are none, so the span can be copied as is.
+// A non-null map recolors the pixels on the way.
+static void draw_span(U8 *d, int dw, int dx, const U8 *p, int sx, int count, int srcw, int shrink, bool flipX, bool opaque, const U8 *map)
+{
+    int nsamples = srcw / shrink; // per row, partial last sample dropped
+    U8 *dst;
+    const U8 *src;
+    int n, step;
+
+    if (!flipX) {
+        // sample source x = multiples of shrink
+        int k0 = std::max((sx + shrink-1) / shrink * shrink, -dx * shrink);
+        int k1 = std::min(std::min(sx + count, nsamples * shrink), (dw - dx) * shrink);
+        dst = d + dx + k0/shrink;
+        src = p + k0 - sx;
+        n = (k1 - k0 + shrink-1) / shrink;
+        step = shrink;
+    } else {
+        // sample source x = srcw-1 - j*shrink, which lands on xbase + j
+        int xbase = dx - 1 - (srcw-1)/shrink;
+        int j0 = std::max((srcw - sx - count + shrink-1) / shrink, -xbase);
+        int j1 = std::min(std::min((srcw - 1 - sx) / shrink, nsamples - 1), dw - 1 - xbase);
+        dst = d + xbase + j0;
+        src = p + srcw - 1 - j0*shrink - sx;
+        n = j1 - j0 + 1;
+        step = -shrink;
+    }
+
+    if (n <= 0)
+        return;
+    if (map)
+        blit_row_remap(dst, src, n, step, map);
+    else if (step == 1 && opaque)
+        memcpy(dst, src, n);
+    else
+        blit_row_transparent(dst, src, n, step);
+}
+
+// ---- sprites
+
+static bool s_filtered_shrink;
+
+void set_filtered_shrink(bool on)
+{
+    s_filtered_shrink = on;
+}
+
+Sprite::Sprite()
+    : x0(0), y0(0), srcw(0), srch(0), filtered_generation(0)
+{
+}
+
+Sprite::Sprite(const PixelSlice &img)
+    : srcw(img.width()), srch(img.height()), filtered_generation(0)
+{
+    pixels = crop_to_opaque(img, &x0, &y0);
+
+    const PixelSlice &p = pixels;
+    rows.reserve(p.height() + 1);
+    for (int y=0; y < p.height(); y++) {
+        rows.push_back((U32) spans.size());
+
+        const U8 *row = p.row(y);
+        int x = 0;
+        while (x < p.width()) {
+            while (x < p.width() && !row[x])
+                x++;
+            int start = x;
+            while (x < p.width() && row[x])
+                x++;
+            if (x > start) {
+                Span s = { (U16) start, (U16) (x - start) };
+                spans.push_back(s);
+            }
+        }
+    }
+    rows.push_back((U32) spans.size());
+}
+
+static const PalEntry *blend_palette();
+
+// Source block [bx0,bx1) x [by0,by1) of an image cropped to p at x0,y0,
+// averaged in pal and mapped back through inverse: 0 unless at least half
+// of it is opaque.
+static U8 average_block(const PixelSlice &p, int x0, int y0, int bx0, int by0, int bx1, int by1,
+    const PalEntry *pal, const U8 *inverse)
+{
+    int n = 0, r = 0, g = 0, b = 0;
+    int ybeg = std::max(by0 - y0, 0), yend = std::min(by1 - y0, p.height());
+    int xbeg = std::max(bx0 - x0, 0), xend = std::min(bx1 - x0, p.width());
+    for (int y=ybeg; y < yend; y++) {
+        const U8 *row = p.row(y);
+        for (int x=xbeg; x < xend; x++) {
+            if (row[x]) {
+                const PalEntry &c = pal[row[x]];
+                r += c.r;
+                g += c.g;
+                b += c.b;
+                n++;
+            }
+        }
+    }
+
+    if (!n || 2*n < (bx1 - bx0) * (by1 - by0))
+        return 0;
+
+    r = (r + n/2) / n;
+    g = (g + n/2) / n;
+    b = (b + n/2) / n;
+    return inverse[(r >> 1)*32*32 + (g >> 1)*32 + (b >> 1)];
+}
+
+// The pixels blit samples at this shrink, to be drawn at shrink 1 instead.
+// Flipped blits sample from the right edge, so they get their own copy.
+// Filtered copies average the block left of a flipped sample, right of a
+// plain one, and go stale with the palette.
+const Sprite &Sprite::shrunk(int shrink, bool flipX, bool filtered) const
+{
+    const PalEntry *pal = 0;
+    const U8 *inverse = 0;
+    if (filtered) {
+        U32 gen = blend_generation();
+        if (filtered_generation != gen) {
+            for (int i=0; i < 4; i++)
+                shrunk_cache[1][i / 2][i % 2].reset();
+            filtered_generation = gen;
+        }
+        pal = blend_palette();
+        inverse = inverse_palette();
+    }
+
+    std::shared_ptr<Sprite> &cached = shrunk_cache[filtered][shrink == 4][flipX];
+    if (cached)
+        return *cached;
+
+    int nsamples = srcw / shrink;
+    int w = flipX ? (srcw-1)/shrink + 1 : nsamples;
+    int h = (srch + shrink-1) / shrink;
+    if (w <= 0) {
+        cached.reset(new Sprite);
+        return *cached;
+    }
+
+    PixelSlice img = PixelSlice::make_scratch(w, h);
+    solid_fill(img, 0);
+    for (int y=0; y < h; y++) {
+        if (filtered) {
+            U8 *dst = img.row(y);
+            int by0 = y*shrink, by1 = std::min(by0 + shrink, srch);
+            for (int x=0; x < w; x++) {
+                int j = w-1 - x;
+                if (flipX && j >= nsamples)
+                    continue;
+                int bx0 = flipX ? srcw - (j+1)*shrink : x*shrink;
+                dst[x] = average_block(pixels, x0, y0, bx0, by0, bx0 + shrink, by1, pal, inverse);
+            }
+            continue;
+        }
+
+        int sy = y*shrink - y0;
+        if (sy < 0 || sy >= pixels.height())
+            continue;
+
+        const U8 *src = pixels.row(sy);
+        U8 *dst = img.row(y);
+        for (int x=0; x < w; x++) {
+            // flipped: x = w-1 - j lands where source srcw-1 - j*shrink does
+            int j = w-1 - x;
+            if (flipX && j >= nsamples)
+                continue;
+            int sx = (flipX ? srcw-1 - j*shrink : x*shrink) - x0;
+            if (sx >= 0 && sx < pixels.width())
+                dst[x] = src[sx];
+        }
+    }
+
+    cached.reset(new Sprite(img));
+    return *cached;
+}
+
+void Sprite::blit(PixelSlice &dest, int dx, int dy, int shrink, bool flipX) const
+{
+    blit_remapped(dest, dx, dy, 0, shrink, flipX);
+}
+
+void Sprite::blit_remapped(PixelSlice &dest, int dx, int dy, const U8 *map, int shrink, bool flipX) const
+{
+    if (!pixels || shrink < 1)
+        return;
+
+    if (shrink == 2 || shrink == 4) {
+        shrunk(shrink, flipX, s_filtered_shrink).blit_remapped(dest, dx, dy, map, 1, flipX);
+        return;
+    }
+    const PixelSlice &p = pixels;
+    for (int y=0; y < p.height(); y++) {
+        int sy = y0 + y;
+        int ty = dy + sy / shrink;
+        if (sy % shrink != 0 || ty < 0 || ty >= dest.height())
+            continue;
+
+        U8 *d = dest.row(ty);
+        const U8 *row = p.row(y);
+        for (U32 i=rows[y]; i < rows[y+1]; i++)
+            draw_span(d, dest.width(), dx, row + spans[i].x, x0 + spans[i].x, spans[i].len, srcw, shrink, flipX, true, map);
+    }
+}
+
+void Sprite::blit_mask(PixelSlice &dest, U8 color, int dx, int dy, bool flipX) const
+{
+    // like blit_to_mask: dest is at half resolution, a 2x2 block of the
+    // source sets its mask pixel if any of the four pixels is opaque.
+    // flipped masks are mirrored about dx, the same way blit does it
+    if (!pixels)
+        return;
+
+    dx >>= 1;
+    dy >>= 1;
+    int nblocks = srcw / 2;
+
+    for (int y=0; y < pixels.height(); y++) {
+        int ty = dy + (y0 + y) / 2;
+        if (ty < 0 || ty >= dest.height())
+            continue;
+
+        U8 *d = dest.row(ty);
+        for (U32 i=rows[y]; i < rows[y+1]; i++) {
+            int b0 = (x0 + spans[i].x) / 2;
+            int b1 = std::min((x0 + spans[i].x + spans[i].len - 1) / 2, nblocks - 1);
+            for (int b=b0; b <= b1; b++) {
+                int tx = flipX ? dx - 1 - b : dx + b;
+                if (tx >= 0 && tx < dest.width())
+                    d[tx] = color;
+            }
+        }
+    }
 }
 
 // ---- file loading
 
-static void decode_rle(U8 *dst, const U8 *src)
+// Both decoders get the sizes of their input and output and return -1 on
+// corrupt data instead of running off either end.
+static int decode_rle(U8 *dst, U32 dstsize, const U8 *src, U32 srcsize)
 {
+    U8 *dstp = dst, *dstend = dst + dstsize;
+    const U8 *srcend = src + srcsize;
+
     for (;;) {
-        U8 cmd = *src++;
-        if (cmd == 0xff) { // run
-            U8 len = *src++;
-            if (!len)
-                break;
+        // literal bytes up to the next run
+        if (src < srcend && *src != 0xff) {
+            const U8 *run = find_byte(src, srcend, 0xff);
+            U32 n = (U32) (run - src);
+            if (n > (U32) (dstend - dstp))
+                return -1;
+
+            copy_bytes(dstp, src, n);
+            dstp += n;
+            src = run;
+        }
+
+        if (srcend - src < 2)
+            return -1; // no terminator
+
+        U8 len = src[1];
+        if (!len)
+            break;
+        if (srcend - src < 3 || len > dstend - dstp)
+            return -1;
 
-            U8 val = *src++;
-            memset(dst, val, len);
-            dst += len;
-        } else
-            *dst++ = cmd;
+        fill_bytes(dstp, src[2], len);
+        dstp += len;
+        src += 3;
     }
+
+    return (int) (dstp - dst);
+}
+
+// The decoders below return false on corrupt data, so they are safe on any
+// thread; the load_ functions panic instead.
+static bool decode_rle_pixels(U8 *dst, int size, const Slice &s)
+{
+    int n = decode_rle(dst, size, &s[0], s.len());
+    if (n < 0)
+        return false;
+
+    memset(dst + n, 0, size - n);
+    return true;
+}
+
+// Draws RLE pixels over dst where they aren't 0, without decoding them
+// anywhere else first
+static bool overlay_rle(PixelSlice &dst, const Slice &s)
+{
+    const U8 *src = &s[0], *srcend = src + s.len();
+    int w = dst.width(), size = w * dst.height();
+    int pos = 0;
+
+    for (;;) {
+        if (src < srcend && *src != 0xff) {
+            const U8 *run = find_byte(src, srcend, 0xff);
+            if (run - src > size - pos)
+                return false;
+
+            while (src < run) {
+                int x = pos % w;
+                int count = std::min((int) (run - src), w - x);
+                blit_row_transparent(dst.row(pos / w) + x, src, count, 1);
+                pos += count;
+                src += count;
+            }
+        }
+
+        if (srcend - src < 2)
+            return false;
+
+        int len = src[1];
+        if (!len)
+            break;
+        if (srcend - src < 3 || len > size - pos)
+            return false;
+
+        U8 color = src[2];
+        while (len) {
+            int x = pos % w;
+            int count = std::min(len, w - x);
+            if (color)
+                fill_bytes(dst.row(pos / w) + x, color, count);
+            pos += count;
+            len -= count;
+        }
+        src += 3;
+    }
+
+    return true;
+}
+
+// scratch images are for decodes that only get drawn or cropped right away
+static PixelSlice new_pixels(int w, int h, bool scratch)
+{
+    return scratch ? PixelSlice::make_scratch(w, h) : PixelSlice::make(w, h);
+}
+
+static bool decode_rle_image(const Slice &s, int w, int h, bool scratch, PixelSlice *out)
+{
+    *out = new_pixels(w, h, scratch);
+    return decode_rle_pixels(out->row(0), w*h, s);
+}
+
+static bool decode_rle_with_header(const Slice &s, bool scratch, PixelSlice *out)
+{
+    if (s.len() < 4)
+        return false;
+    return decode_rle_image(s(4), little_u16(&s[0]), little_u16(&s[2]), scratch, out);
+}
+
+static bool decode_hot(const Slice &s, PixelSlice *out)
+{
+    PixelSlice p;
+    if (!decode_rle_with_header(s, false, &p))
+        return false;
+    *out = p.reinterpret(p.width() / 2, p.height() * 2);
+    return true;
 }
 
 PixelSlice load_rle_pixels(const Slice &s, int w, int h)
 {
-    PixelSlice p = PixelSlice::make(w, h);
-    decode_rle(p.row(0), &s[0]);
+    PixelSlice p;
+    if (!decode_rle_image(s, w, h, false, &p))
+        panic("corrupt RLE data");
     return p;
 }
 
 PixelSlice load_rle_with_header(const Slice &s)
 {
-    return load_rle_pixels(s(4), little_u16(&s[0]), little_u16(&s[2]));
+    PixelSlice p;
+    if (!decode_rle_with_header(s, false, &p))
+        panic("corrupt RLE data");
+    return p;
 }
 
 PixelSlice load_hot(const Slice &s)
 {
-    PixelSlice p = load_rle_with_header(s);
-    return p.reinterpret(p.width() / 2, p.height() * 2);
+    PixelSlice p;
+    if (!decode_hot(s, &p))
+        panic("corrupt RLE data");
+    return p;
+}
+
+// Walks a delta stream, handing each literal span to emit(pos, bytes, len),
+// where pos is the offset in a 320-wide image. Returns the number of pixels
+// covered, or -1 if the data is corrupt or goes past maxpos.
+template<class Emit>
+static int walk_delta(const U8 *src, U32 srcsize, U32 maxpos, const Emit &emit)
+{
+    const U8 *srcend = src + srcsize;
+    if (srcsize < 2)
+        return -1;
+
+    U32 pos = little_u16(src);
+    src += 2;
+    for (;;) {
+        if (srcend - src < 2)
+            return -1;
+
+        U32 len = little_u16(src);
+        src += 2;
+        if (len > (U32) (srcend - src) || pos + len > maxpos)
+            return -1;
+
+        emit(pos, src, len);
+        pos += len;
+        src += len;
+
+        if (srcend - src < 3)
+            return -1;
+
+        src++; // what does this byte do?
+        U32 skip = little_u16(src);
+        src += 2;
+        if (!skip)
+            break;
+        pos += skip;
+    }
+
+    return (int) pos;
 }
 
-static int decode_delta(U8 *dst, const U8 *p)
+static int decode_delta(U8 *dst, U32 dstsize, const U8 *src, U32 srcsize)
 {
-    U8 *dsto = dst;
-    int skip = little_u16(p);
-    dst += skip;
-    p += 2;
-    do {
-        int len = little_u16(p);
-        memcpy(dst, p + 2, len);
-        dst += len;
-        p += len + 2;
+    return walk_delta(src, srcsize, dstsize, [dst](U32 pos, const U8 *p, U32 len) {
+        copy_bytes(dst + pos, p, len);
+    });
+}
 
-        p++; // what does this byte do?
-        skip = little_u16(p);
-        p += 2;
-        dst += skip;
-    } while (skip);
-    return (int) (dst - dsto);
+static bool decode_delta_image(const Slice &s, bool scratch, PixelSlice *out)
+{
+    PixelSlice p = new_pixels(VGA_WIDTH, VGA_HEIGHT, scratch);
+    solid_fill(p, 0);
+    int n = decode_delta(p.row(0), VGA_WIDTH * VGA_HEIGHT, &s[0], s.len());
+    if (n < 0)
+        return false;
+    *out = p.slice(0, 0, VGA_WIDTH, (n + VGA_WIDTH-1) / VGA_WIDTH);
+    return true;
 }
 
 PixelSlice load_delta_pixels(const Slice &s)
 {
-    PixelSlice p = PixelSlice::black(VGA_WIDTH, VGA_HEIGHT);
-    int n = decode_delta(p.row(0), &s[0]);
-    return p.slice(0, 0, VGA_WIDTH, (n + VGA_WIDTH-1) / VGA_WIDTH);
+    PixelSlice p;
+    if (!decode_delta_image(s, false, &p))
+        panic("corrupt delta data");
+    return p;
+}
+
+void blit_delta_transparent(PixelSlice &dest, int dx, int dy, const Slice &data, int shrink, bool flipX)
+{
+    if (shrink < 1)
+        return;
+
+    // same result as blit_transparent_shrink on load_delta_pixels, but the
+    // spans go straight from the stream to dest
+    const int W = VGA_WIDTH;
+    int dh = dest.height();
+
+    int n = walk_delta(&data[0], data.len(), W * VGA_HEIGHT, [&](U32 pos, const U8 *p, U32 len) {
+        while (len) {
+            int sy = pos / W;
+            int sx = pos % W;
+            int count = std::min((int) len, W - sx);
+            int y = dy + sy / shrink;
+
+            if (sy % shrink == 0 && y >= 0 && y < dh)
+                draw_span(dest.row(y), dest.width(), dx, p, sx, count, W, shrink, flipX, false, 0);
+
+            pos += count;
+            p += count;
+            len -= count;
+        }
+    });
+
+    if (n < 0)
+        panic("corrupt delta data");
+}
+
+static bool decode_gra_item(const GraArchive &lib, const GraArchive::Item *item, bool scratch, PixelSlice *out)
+{
+    if (!lib.filename().empty()) {
+        *out = bundle_find_pixels(lib.filename(), item->name);
+        if (*out)
+            return true;
+    }
+
+    if (item->type == 5)
+        return decode_delta_image(lib.data(item), scratch, out);
+    else if (item->type == 8)
+        return decode_rle_with_header(lib.data(item), scratch, out);
+    else
+        return true;
+}
+
+static PixelSlice need_gra_item(const GraArchive &lib, const GraArchive::Item *item, bool scratch)
+{
+    PixelSlice p;
+    if (!decode_gra_item(lib, item, scratch, &p))
+        panic("corrupt image %s", item->name.c_str());
+    return p;
+}
+
+PixelSlice load_gra_item(const GraArchive &lib, const GraArchive::Item *item)
+{
+    return need_gra_item(lib, item, false);
+}
+
+Sprite load_gra_sprite(const GraArchive &lib, const GraArchive::Item *item)
+{
+    return Sprite(need_gra_item(lib, item, true));
+}
+
+void blit_gra_item(PixelSlice &dest, int dx, int dy, const GraArchive &lib, const GraArchive::Item *item, int shrink, bool flipX)
+{
+    // prefer pixels the bundle has decoded already; delta items are
+    // otherwise drawn straight from the archive
+    PixelSlice pixels;
+    if (!lib.filename().empty())
+        pixels = bundle_find_pixels(lib.filename(), item->name);
+
+    if (!pixels && item->type == 5)
+        blit_delta_transparent(dest, dx, dy, lib.data(item), shrink, flipX);
+    else
+        blit_transparent_shrink(dest, dx, dy, pixels ? pixels : need_gra_item(lib, item, true), shrink, flipX);
 }
 
 // ---- functions
@@ -327,7 +892,8 @@ Palette vga_pal;
 
 void graphics_init()
 {
-    vga_screen = PixelSlice::black(VGA_WIDTH, VGA_HEIGHT);
+    vga_screen = PixelSlice::make_aligned(VGA_WIDTH, VGA_HEIGHT);
+    solid_fill(vga_screen, 0);
 }
 
 void graphics_shutdown()
@@ -373,6 +939,178 @@ void set_palb_fade(int intensity)
     }
 }
 
+// ---- blending
+
+static const int BLEND_STEPS = 16; // amounts are rounded to 16ths
+static const int TABLE_SLACK = 3; // for the gathers in blend_row/lookup_row
+
+// Color cycles rewrite their entries of palette_a every frame. The tables
+// ignore those changes: cycled entries keep the color they had when the
+// tables were built and are never picked as a closest color.
+static U8 s_cycled[256]; // color cycles running over each entry
+
+namespace {
+    struct BlendTables {
+        Palette pal;                // palette_a as the tables were built from
+        U8 cycled[256];             // s_cycled at the time
+        S16 planes[3*256];          // pal for closest_color, -1 where cycled
+        bool built;
+        std::vector<U8> half;       // [src*256 + dst], empty until used
+        std::vector<U8> shade[BLEND_STEPS + 1];
+        std::unordered_map<int, std::vector<U8> > tints; // by color*(BLEND_STEPS + 1) + step
+        std::vector<U8> inverse;    // 32*32*32, see build_inverse_palette
+        U32 generation;             // counts rebuilds
+    };
+}
+
+static BlendTables s_blend;
+
+static bool same_base_palette(const BlendTables &t)
+{
+    if (memcmp(t.cycled, s_cycled, sizeof(s_cycled)))
+        return false;
+
+    for (int i=0; i < 256; i++) {
+        const PalEntry &a = t.pal[i], &b = palette_a[i];
+        if (!s_cycled[i] && (a.r != b.r || a.g != b.g || a.b != b.b))
+            return false;
+    }
+    return true;
+}
+
+// drops whatever was built for an older palette
+static BlendTables &blend_tables()
+{
+    BlendTables &t = s_blend;
+    if (t.built && same_base_palette(t))
+        return t;
+
+    memcpy(t.pal, palette_a, sizeof(Palette));
+    memcpy(t.cycled, s_cycled, sizeof(s_cycled));
+    for (int i=0; i < 256; i++) {
+        bool use = !t.cycled[i];
+        t.planes[i] = use ? t.pal[i].r : -1;
+        t.planes[256 + i] = use ? t.pal[i].g : -1;
+        t.planes[512 + i] = use ? t.pal[i].b : -1;
+    }
+
+    t.half.clear();
+    for (int i=0; i <= BLEND_STEPS; i++)
+        t.shade[i].clear();
+    t.tints.clear();
+    t.inverse.clear();
+    t.generation++;
+    t.built = true;
+    return t;
+}
+
+static int blend_step(int amount)
+{
+    return std::max(0, std::min((amount * BLEND_STEPS + 128) / 256, BLEND_STEPS));
+}
+
+// map[c] = the color closest to c moved step/BLEND_STEPS of the way to r,g,b
+static void build_mix_map(std::vector<U8> &map, const BlendTables &t, int r, int g, int b, int step)
+{
+    map.resize(256 + TABLE_SLACK);
+    for (int c=0; c < 256; c++) {
+        const PalEntry &p = t.pal[c];
+        map[c] = (U8) closest_color(t.planes,
+            p.r + (r - p.r) * step / BLEND_STEPS,
+            p.g + (g - p.g) * step / BLEND_STEPS,
+            p.b + (b - p.b) * step / BLEND_STEPS);
+    }
+}
+
+const U8 *blend_half_table()
+{
+    BlendTables &t = blend_tables();
+    if (t.half.empty()) {
+        t.half.resize(256*256 + TABLE_SLACK);
+        for (int s=0; s < 256; s++) {
+            for (int d=0; d <= s; d++) {
+                const PalEntry &a = t.pal[s], &b = t.pal[d];
+                U8 c = (U8) closest_color(t.planes, (a.r + b.r + 1) / 2, (a.g + b.g + 1) / 2, (a.b + b.b + 1) / 2);
+                t.half[s*256 + d] = t.half[d*256 + s] = c;
+            }
+        }
+    }
+    return &t.half[0];
+}
+
+const U8 *blend_shade_map(int amount)
+{
+    BlendTables &t = blend_tables();
+    int step = blend_step(amount);
+    if (t.shade[step].empty())
+        build_mix_map(t.shade[step], t, 0, 0, 0, step);
+    return &t.shade[step][0];
+}
+
+const U8 *blend_tint_map(U8 color, int amount)
+{
+    BlendTables &t = blend_tables();
+    int step = blend_step(amount);
+    std::vector<U8> &map = t.tints[color * (BLEND_STEPS + 1) + step];
+    if (map.empty())
+        build_mix_map(map, t, t.pal[color].r, t.pal[color].g, t.pal[color].b, step);
+    return &map[0];
+}
+
+void blit_translucent(PixelSlice &dest, int dx, int dy, const PixelSlice &src)
+{
+    Rect sr;
+    if (!clipblit(&sr, dx, dy, dest, src))
+        return;
+
+    const U8 *table = blend_half_table();
+    int w = sr.x1 - sr.x0;
+    for (int sy=sr.y0; sy < sr.y1; sy++)
+        blend_row(dest.ptr(dx+sr.x0, dy+sy), src.ptr(sr.x0, sy), w, table);
+}
+
+void blit_shadow(PixelSlice &dest, int dx, int dy, const PixelSlice &mask, int amount)
+{
+    Rect sr;
+    if (!clipblit(&sr, dx, dy, dest, mask))
+        return;
+
+    const U8 *map = blend_shade_map(amount);
+    int w = sr.x1 - sr.x0;
+    for (int sy=sr.y0; sy < sr.y1; sy++)
+        lookup_row(dest.ptr(dx+sr.x0, dy+sy), mask.ptr(sr.x0, sy), w, map);
+}
+
+void remap_pixels(PixelSlice &dest, const U8 *map)
+{
+    // callers hand in plain 256-byte maps; the gathers need the slack
+    U8 padded[256 + TABLE_SLACK] = { 0 };
+    memcpy(padded, map, 256);
+    for (int y=0; y < dest.height(); y++)
+        lookup_row(dest.row(y), 0, dest.width(), padded);
+}
+
+const U8 *inverse_palette()
+{
+    // 0 is transparent to the blitters, and fix_palette keeps another black
+    BlendTables &t = blend_tables();
+    if (t.inverse.empty()) {
+        t.inverse.resize(32*32*32);
+        build_inverse_palette(t.planes, 1, &t.inverse[0]);
+    }
+    return &t.inverse[0];
+}
+
+static const PalEntry *blend_palette()
+{
+    return blend_tables().pal;
+}
+
+U32 blend_generation()
+{
+    return blend_tables().generation;
+}
+
 // ---- animation
 
 Animation::~Animation()
@@ -391,6 +1129,7 @@ class ColorCycleAnimation : public Animation {
 
 public:
     ColorCycleAnimation(int first, int last, int delay, int dir);
+    virtual ~ColorCycleAnimation();
 
     virtual void tick();
     virtual void render(PixelSlice &target);
@@ -427,6 +1166,14 @@ ColorCycleAnimation::ColorCycleAnimation(int first, int last, int delay, int dir
 {
     memcpy(orig_a, palette_a, sizeof(Palette));
     memcpy(orig_b, palette_b, sizeof(Palette));
+    for (int i=std::max(first, 0); i <= std::min(last, 255); i++)
+        s_cycled[i]++;
+}
+
+ColorCycleAnimation::~ColorCycleAnimation()
+{
+    for (int i=std::max(first, 0); i <= std::min(last, 255); i++)
+        s_cycled[i]--;
 }
 
 void ColorCycleAnimation::tick()
@@ -460,8 +1207,47 @@ Animation *new_color_cycle_anim(int first, int last, int delay, int dir)
     return new ColorCycleAnimation(first, last, delay, dir);
 }
 
+// RLE animations whose frames would take more than this get keyframes
+static U32 s_big_anim_budget = 256 * 1024;
+
+void set_big_anim_budget(U32 bytes)
+{
+    s_big_anim_budget = bytes;
+}
+
+// Frames between keyframes so that the keyframes plus a ring of one
+// interval fit the budget; 0 if all frames fit.
+static int pick_key_interval(int nframes, U32 framesize)
+{
+    if ((U64) nframes * framesize <= s_big_anim_budget)
+        return 0;
+
+    int best = nframes;
+    U32 best_count = ~0u;
+    for (int i=2; i <= nframes; i++) {
+        U32 count = (nframes + i-1) / i + i-1;
+        if ((U64) count * framesize <= s_big_anim_budget)
+            return i;
+        if (count < best_count) {
+            best = i;
+            best_count = count;
+        }
+    }
+    return best; // doesn't fit, take the smallest
+}
+
 class BigAnimation : public Animation { // .ani / .big files
-    PixelSlice data;
+    PixelSlice data;            // all frames, unless in keyframe mode
+
+    // keyframe mode: every key_interval-th frame in decode order (last to
+    // first) is kept; the others are rebuilt from the file's RLE deltas into
+    // a ring holding the rest of one interval
+    Slice file;
+    std::vector<U32> rle_offs;  // per frame
+    std::vector<PixelSlice> keys;
+    std::vector<PixelSlice> ring;
+    std::vector<int> ring_frame;
+    int key_interval;
 
     int posx, posy;
     int w, h;
@@ -469,7 +1255,9 @@ class BigAnimation : public Animation { // .ani / .big files
     int cur_frame, cur_tick;
     int flags;
 
-    PixelSlice get_frame(int frame) const;
+    void apply_delta(PixelSlice &dst, int frame) const;
+    void decode_deltas(int hi, int lo, PixelSlice *out) const;
+    PixelSlice get_frame(int frame);
 
 public:
     BigAnimation(const Str &filename, int flags);
@@ -481,16 +1269,76 @@ public:
     virtual void rewind();
 };
 
-PixelSlice BigAnimation::get_frame(int frame) const
+void BigAnimation::apply_delta(PixelSlice &dst, int frame) const
+{
+    if (!overlay_rle(dst, file(rle_offs[frame] + 2)))
+        panic("corrupt RLE data");
+}
+
+// RLE records of frames hi down to lo, decoded on the workers; out must
+// have hi-lo+1 contiguous w*h images and gets them in decode order
+void BigAnimation::decode_deltas(int hi, int lo, PixelSlice *out) const
 {
-    if (!data || frame < 0 || frame > last_frame)
+    // the workers only note corrupt data; it's reported from here
+    std::atomic<bool> corrupt;
+    corrupt = false;
+
+    JobGroup jobs;
+    for (int frame = hi; frame >= lo; frame--) {
+        U8 *dst = out[hi - frame].row(0);
+        Slice rle = file(rle_offs[frame] + 2);
+        int size = w * h;
+        std::atomic<bool> *flag = &corrupt;
+        jobs.run([dst, size, rle, flag] {
+            if (!decode_rle_pixels(dst, size, rle))
+                *flag = true;
+        });
+    }
+
+    jobs.wait();
+    if (corrupt)
+        panic("corrupt RLE data");
+}
+
+PixelSlice BigAnimation::get_frame(int frame)
+{
+    if (frame < 0 || frame > last_frame)
         return PixelSlice();
+    if (!key_interval)
+        return data ? data.slice(0, frame * h, w, (frame + 1)*h) : PixelSlice();
+
+    int key = (last_frame - frame) / key_interval;
+    int steps = (last_frame - frame) % key_interval;
+    if (!steps)
+        return keys[key];
+    if (ring_frame[steps - 1] == frame)
+        return ring[steps - 1];
+
+    // continue from the closest frame of this interval that's still there
+    int from = frame + steps;
+    for (int f = frame + 1; f < frame + steps; f++) {
+        if (ring_frame[(last_frame - f) % key_interval - 1] == f) {
+            from = f;
+            break;
+        }
+    }
 
-    return data.slice(0, frame * h, w, (frame + 1)*h);
+    PixelSlice prev = (from == frame + steps) ? keys[key] : ring[(last_frame - from) % key_interval - 1];
+    for (int f = from - 1; f >= frame; f--) {
+        int slot = (last_frame - f) % key_interval - 1;
+        if (!ring[slot])
+            ring[slot] = PixelSlice::make_aligned(w, h);
+
+        blit(ring[slot], 0, 0, prev);
+        apply_delta(ring[slot], f);
+        ring_frame[slot] = f;
+        prev = ring[slot];
+    }
+    return prev;
 }
 
 BigAnimation::BigAnimation(const Str &filename, int flags)
-    : posx(0), posy(0), w(0), h(0),
+    : key_interval(0), posx(0), posy(0), w(0), h(0),
     last_frame(-1), wait_frames(1), cur_frame(0), cur_tick(0),
     flags(flags)
 {
@@ -509,25 +1357,77 @@ BigAnimation::BigAnimation(const Str &filename, int flags)
     int fps = s[10];
 
     wait_frames = 70 / fps;
-    data = PixelSlice::make(w, (last_frame + 1)*h);
 
     // read contents (frames are stored in reverse order!)
     if (mode > 0x60) {
+        file = s;
+        rle_offs.resize(last_frame + 1);
         U32 pos = 11;
         for (int frame = last_frame; frame >= 0; frame--) {
-            PixelSlice dst = get_frame(frame);
-            if (frame != last_frame)
-                blit(dst, 0, 0, get_frame(frame + 1));
-
             assert(pos + 2 <= s.len());
-            int src_size = little_u16(&s[pos]);
-            blit_transparent(dst, 0, 0, load_rle_pixels(s(pos + 2), w, h));
-            pos += src_size;
+            rle_offs[frame] = pos;
+            pos += little_u16(&s[pos]);
         }
+
+        // rebuilding frames is expensive, so we keep the results around
+        std::vector<PixelSlice> cached;
+        key_interval = pick_key_interval(last_frame + 1, w * h);
+        if (key_interval) {
+            U32 nkeys = last_frame / key_interval + 1;
+            if (diskcache_load("anikeys", filename, s, &cached) && cached.size() == nkeys &&
+                cached[0].width() == w && cached[0].height() == h)
+                keys = cached;
+            else {
+                // decode a batch at a time in parallel, then layer them up
+                static const int BATCH = 16;
+                std::vector<PixelSlice> batch;
+                for (int i=0; i < std::min(BATCH, last_frame + 1); i++)
+                    batch.push_back(PixelSlice::make_scratch(w, h));
+
+                PixelSlice cur = PixelSlice::make_scratch(w, h);
+                solid_fill(cur, 0);
+                for (int hi = last_frame; hi >= 0; hi -= BATCH) {
+                    int lo = std::max(hi - BATCH + 1, 0);
+                    decode_deltas(hi, lo, &batch[0]);
+                    for (int frame = hi; frame >= lo; frame--) {
+                        blit_transparent(cur, 0, 0, batch[hi - frame]);
+                        if ((last_frame - frame) % key_interval == 0)
+                            keys.push_back(cur.clone());
+                    }
+                }
+                diskcache_store("anikeys", filename, s, keys);
+            }
+
+            ring.resize(key_interval - 1);
+            ring_frame.resize(key_interval - 1, -1);
+            return;
+        }
+
+        if (diskcache_load("ani", filename, s, &cached) && cached.size() == 1 &&
+            cached[0].width() == w && cached[0].height() == (last_frame + 1)*h) {
+            data = cached[0];
+            return;
+        }
+
+        // decode every frame's own pixels in parallel, then let each one
+        // show the frame decoded before it through its transparent pixels
+        data = PixelSlice::make(w, (last_frame + 1)*h);
+        std::vector<PixelSlice> frames;
+        for (int frame = last_frame; frame >= 0; frame--)
+            frames.push_back(get_frame(frame));
+        decode_deltas(last_frame, 0, &frames[0]);
+
+        PixelSlice tmp = PixelSlice::make_scratch(w, h);
+        for (int frame = last_frame - 1; frame >= 0; frame--) {
+            blit(tmp, 0, 0, get_frame(frame + 1));
+            blit_transparent(tmp, 0, 0, get_frame(frame));
+            blit(frames[last_frame - frame], 0, 0, tmp);
+        }
+        diskcache_store("ani", filename, s, std::vector<PixelSlice>(1, data));
     } else {
         int nbytes = (last_frame + 1) * w * h;
         assert(s.len() == nbytes + 11);
-        memcpy(data.row(0), &s[11], nbytes);
+        data = PixelSlice::wrap(s(11), w, (last_frame + 1)*h);
     }
 }
 
@@ -574,7 +1474,12 @@ Animation *new_big_anim(const Str &filename, int flags)
 }
 
 class MegaAnimation : public Animation { // .gra files
-    Slice grafile;
+    struct Frame {
+        Sprite sprite;      // unscaled; blit does the scaling and flipping
+        bool decoded;
+    };
+
+    std::shared_ptr<const GraArchive> gra;
     Str nameprefix;
     int first_frame, last_frame;
     int posx, posy;
@@ -582,6 +1487,10 @@ class MegaAnimation : public Animation { // .gra files
     int scale, flip;
     int cur_frame, cur_tick;
     int loops_left;
+    std::vector<Frame> frames; // first_frame..last_frame, decoded on first display
+
+    const GraArchive::Item *find_item(int frame) const;
+    const Frame &get_frame(int frame);
 
 public:
     MegaAnimation(const Str &grafilename, const Str &prefix, int first_frame, int last_frame,
@@ -599,9 +1508,12 @@ MegaAnimation::MegaAnimation(const Str &grafilename, const Str &prefix, int firs
     : nameprefix(prefix), first_frame(first_frame), last_frame(last_frame), posx(posx), posy(posy),
     delay(delay), scale(scale), flip(flip), cur_frame(first_frame), cur_tick(0)
 {
-    grafile = read_file(grafilename);
+    gra = read_gra(grafilename);
     loops_left = last_frame / 1000;
     this->last_frame %= 1000;
+
+    Frame empty = { Sprite(), false };
+    frames.resize(std::max(this->last_frame - first_frame + 1, 0), empty);
 }
 
 MegaAnimation::~MegaAnimation()
@@ -620,18 +1532,38 @@ void MegaAnimation::tick()
     }
 }
 
+const GraArchive::Item *MegaAnimation::find_item(int frame) const
+{
+    Str name = Str::fmt("%s%d", nameprefix.c_str(), frame);
+    const GraArchive::Item *item = gra->find(name);
+    if (!item || item->type != 5)
+        panic("bad anim! (prefix=%s frame=%d type=%d)", nameprefix.c_str(), frame, item ? item->type : -1);
+    return item;
+}
+
+const MegaAnimation::Frame &MegaAnimation::get_frame(int frame)
+{
+    Frame &f = frames[frame - first_frame];
+    if (f.decoded)
+        return f;
+
+    // the sprite keeps its own scaled copies, filtered ones included
+    f.sprite = load_gra_sprite(*gra, find_item(frame));
+    f.decoded = true;
+    return f;
+}
+
 void MegaAnimation::render(PixelSlice &target)
 {
     if (cur_tick)
         return;
 
-    U8 type;
-    Str name = Str::fmt("%s%d", nameprefix.c_str(), cur_frame);
-    int offs = find_gra_item(grafile, name.c_str(), &type);
-    if (offs < 0 || type != 5)
-        panic("bad anim! (prefix=%s frame=%d offs=%d type=%d)", nameprefix, cur_frame, offs, type);
+    if (cur_frame < first_frame || cur_frame > last_frame) { // not in the store
+        blit_gra_item(target, posx, posy, *gra, find_item(cur_frame), scale, flip != 0);
+        return;
+    }
 
-    blit_transparent_shrink(target, posx, posy, load_delta_pixels(grafile(offs)), scale, flip != 0);
+    get_frame(cur_frame).sprite.blit(target, posx, posy, scale, flip != 0);
 }
 
 bool MegaAnimation::is_done() const
@@ -720,19 +1652,31 @@ static void flipx_screen()
     int w = vga_screen.width();
     int h = vga_screen.height();
 
-    for (int y=0; y < h; y++) {
-        U8 *row = vga_screen.row(y);
-        for (int x=0; x < w/2; x++) {
-            U8 a = row[x];
-            U8 b = row[w-1-x];
-            row[x] = b;
-            row[w-1-x] = a;
-        }
-    }
+    for (int y=0; y < h; y++)
+        reverse_row(vga_screen.row(y), w);
+}
+
+namespace {
+    struct MixDraw {
+        const GraArchive::Item *item;
+        int x, y;
+        int shrink;
+        bool flipX;
+        bool visible;       // .vb condition held
+        int hotIndex;
+        bool corrupt;       // set by the decode job, reported here
+        Sprite sprite;      // delta items
+        PixelSlice pixels;  // RLE items, drawn opaque
+    };
 }
 
 static void decode_mix(MixItem *items, int count, const Str &vbFilename)
 {
+    // start loading the library while we decode the background
+    std::vector<Str> prefetch;
+    prefetch.push_back(Str::pascl(items[1].pasNameStr));
+    prefetch_files(prefetch);
+
     // background
     load_background(Str::pascl(items->pasNameStr));
     scale_palette(palette_a, 128, items->para1l, items->para2, items->para3);
@@ -740,7 +1684,8 @@ static void decode_mix(MixItem *items, int count, const Str &vbFilename)
         flipx_screen();
 
     // library
-    Slice libFile = read_file(Str::pascl(items[1].pasNameStr));
+    std::shared_ptr<const GraArchive> libptr = read_gra(Str::pascl(items[1].pasNameStr));
+    const GraArchive &lib = *libptr;
     Slice vbFile = try_read_xored(vbFilename);
     int hotIndex = 0;
 
@@ -752,29 +1697,64 @@ static void decode_mix(MixItem *items, int count, const Str &vbFilename)
 
     PixelSlice pic_window = vga_screen.slice(0, PIC_WINDOW_Y0, vga_screen.width(), PIC_WINDOW_Y1);
 
-    // items
+    // items: the conditions are evaluated here, in order (the expression
+    // parser isn't thread safe), then the decoding fans out to the workers
+    std::vector<MixDraw> draws;
+    draws.reserve(count);
     for (int i=2; i < count; i++) {
         Str name = Str::pascl(items[i].pasNameStr);
-        U8 type;
-        int offs = find_gra_item(libFile, name, &type);
-        if (offs < 0) {
+        const GraArchive::Item *item = lib.find(name);
+        if (!item) {
             printf("didn't find %s!\n", name.c_str());
             continue;
         }
 
         Slice vbLine = chop_line(vbFile);
-        if (vbLine.len() == 0 || eval_bool_expr(vbLine)) {
-            int x = items[i].para1l + (items[i].para1h << 8);
-            int y = items[i].para2 - PIC_WINDOW_Y0;
-
-            if (type == 5) // delta
-                blit_transparent_shrink(pic_window, x, y, load_delta_pixels(libFile(offs)), items[i].para3, items[i].flipX != 0);
-            else if (type == 8) // RLE
-                blit(pic_window, x, y, load_rle_with_header(libFile(offs)));
-        } else
-            game_hotspot_disable(hotIndex);
+        MixDraw d;
+        d.item = item;
+        d.x = items[i].para1l + (items[i].para1h << 8);
+        d.y = items[i].para2 - PIC_WINDOW_Y0;
+        d.shrink = items[i].para3;
+        d.flipX = items[i].flipX != 0;
+        d.visible = vbLine.len() == 0 || eval_bool_expr(vbLine);
+        d.hotIndex = hotIndex++;
+        d.corrupt = false;
+        draws.push_back(d);
+    }
 
-        hotIndex++;
+    {
+        JobGroup jobs;
+        for (size_t i=0; i < draws.size(); i++) {
+            MixDraw *d = &draws[i];
+            if (!d->visible)
+                continue;
+
+            if (d->item->type == 5) { // delta
+                if (d->shrink >= 1) {
+                    jobs.run([&lib, d] {
+                        PixelSlice p;
+                        d->corrupt = !decode_gra_item(lib, d->item, true, &p);
+                        d->sprite = Sprite(p);
+                    });
+                }
+            } else if (d->item->type == 8) // RLE
+                jobs.run([&lib, d] { d->corrupt = !decode_gra_item(lib, d->item, false, &d->pixels); });
+        }
+    } // waits for all decodes
+
+    for (size_t i=0; i < draws.size(); i++)
+        if (draws[i].corrupt)
+            panic("corrupt image %s", draws[i].item->name.c_str());
+
+    // draw in the original order
+    for (size_t i=0; i < draws.size(); i++) {
+        const MixDraw &d = draws[i];
+        if (!d.visible)
+            game_hotspot_disable(d.hotIndex);
+        else if (d.item->type == 5)
+            d.sprite.blit(pic_window, d.x, d.y, d.shrink, d.flipX);
+        else if (d.item->type == 8)
+            blit(pic_window, d.x, d.y, d.pixels);
     }
 }
 
@@ -791,6 +1771,23 @@ void load_palette(const Str &filename)
     load_palette_data(read_file(filename));
 }
 
+// false if the file is truncated or corrupt
+static bool decode_background(const Slice &s, PixelSlice *out)
+{
+    // gross, but this is the original logic from the game
+    if (s.len() > 63990) {
+        if (s.len() < 768 + VGA_WIDTH * VGA_HEIGHT)
+            return false;
+        *out = PixelSlice::wrap(s(768), VGA_WIDTH, VGA_HEIGHT);
+        return true;
+    } else if (s.len() < 772)
+        return false;
+    else if (little_u16(&s[768]) == 320 && little_u16(&s[770]) == 200)
+        return decode_rle_with_header(s(768), false, out);
+    else
+        return decode_delta_image(s(768), false, out);
+}
+
 void load_background(const Str &filename, int screen)
 {
     Slice s = read_file(filename);
@@ -800,15 +1797,59 @@ void load_background(const Str &filename, int screen)
         decode_mix((MixItem *)&s[0], s.len() / sizeof(MixItem), vbFilename);
     } else {
         if (!has_suffixi(filename, ".pal")) {
-            // gross, but this is the original logic from the game
-            if (s.len() > 63990)
-                memcpy(vga_screen.ptr(0, 0), &s[768], VGA_WIDTH * VGA_HEIGHT);
-            else if (little_u16(&s[768]) == 320 && little_u16(&s[770]) == 200)
-                blit(vga_screen, 0, 0, load_rle_with_header(s(768)));
-            else
-                blit(vga_screen, 0, 0, load_delta_pixels(s(768)));
+            PixelSlice pixels = find_predecoded_image(filename);
+            if (!pixels && !decode_background(s, &pixels))
+                panic("%s: corrupt image", filename.c_str());
+            blit(vga_screen, 0, 0, pixels);
         }
 
         load_palette_data(s);
     }
 }
+
+// ---- predecoding
+
+static ImageMap s_predecoded;
+
+// Nothing here may panic: whatever is missing or corrupt is left out, and
+// the main thread reports it when it loads the file itself.
+void predecode_background(const Str &filename, ImageMap *images)
+{
+    Slice s = try_read_file(filename);
+    if (!s)
+        return;
+
+    if (has_suffixi(filename, ".mix")) {
+        // the item composition depends on script state, so that stays with
+        // load_background; we can still do the background and the loading
+        const MixItem *items = (const MixItem *)&s[0];
+        if (s.len() >= 2 * sizeof(MixItem)) {
+            predecode_background(Str::pascl(items[0].pasNameStr), images);
+            try_read_file(Str::pascl(items[1].pasNameStr));
+        }
+        try_read_xored(replace_ext(filename, ".vb"));
+    } else if (!has_suffixi(filename, ".pal")) {
+        PixelSlice pixels;
+        if (decode_background(s, &pixels))
+            (*images)[normalize_path(filename)] = pixels;
+    }
+}
+
+void predecode_hotmap(const Str &filename, ImageMap *images)
+{
+    PixelSlice pixels;
+    Slice s = try_read_file(filename);
+    if (s && decode_hot(s, &pixels))
+        (*images)[normalize_path(filename)] = pixels;
+}
+
+void set_predecoded_images(const ImageMap &images)
+{
+    s_predecoded = images;
+}
+
+PixelSlice find_predecoded_image(const Str &filename)
+{
+    auto it = s_predecoded.find(normalize_path(filename));
+    return (it != s_predecoded.end()) ? it->second : PixelSlice();
+}
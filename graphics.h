@@ -2,10 +2,9 @@
 #define __GRAPHICS_H__
 
 #include "common.h"
-
+#include "util.h"
+#include <memory>
 struct PixelBuffer;
-class Str;
-class Slice;
 
 struct Rect {
     int x0, y0;
@@ -16,43 +15,103 @@ class PixelSlice {
     PixelBuffer *buf;   // underlying storage
     U8 *pixels;         // start of data
     int w, h, stride;
+    bool readonly;      // views over asset bytes may not be written
+
+    PixelSlice(PixelBuffer *buf, int w, int h, int stride);
 
-    PixelSlice(PixelBuffer *buf, int w, int h);
+    void narrow(int x0, int y0, int x1, int y1);
+    void write_denied() const;
+    void move_from(PixelSlice &x)       { buf = x.buf; pixels = x.pixels; w = x.w; h = x.h; stride = x.stride; readonly = x.readonly; x.buf = 0; }
 
 public:
     explicit PixelSlice();
+    PixelSlice(PixelSlice &&x)          { move_from(x); }
     PixelSlice(const PixelSlice &x);
     ~PixelSlice();
 
     static PixelSlice make(int w, int h);
+    static PixelSlice make_aligned(int w, int h); // rows start on 64-byte boundaries; stride padded to match
     static PixelSlice black(int w, int h);
+    static PixelSlice wrap(const Slice &bytes, int w, int h); // read-only view, no copy; see make_writable
+    static PixelSlice make_scratch(int w, int h); // scratch arena; must be dropped before the frame ends
 
     PixelSlice &operator =(const PixelSlice &x);
+    PixelSlice &operator =(PixelSlice &&x);
 
     const PixelSlice slice(int x0, int y0, int x1, int y1) const;
-    PixelSlice slice(int x0, int y0, int x1, int y1) { return (PixelSlice) ((const PixelSlice&) *this).slice(x0, y0, x1, y1); }
+    PixelSlice slice(int x0, int y0, int x1, int y1);
 
     PixelSlice clone() const;
-    PixelSlice reinterpret(int neww, int newh);
+    void make_writable(); // copies the pixels if this is a read-only view
+    PixelSlice reinterpret(int neww, int newh); // only where stride == width
     PixelSlice make_resized(int neww, int newh) const;
     PixelSlice replace_colors(const U8 *from_col, const U8 *to_col, int ncols) const;
 
     const U8 *row(int y) const          { return pixels + y * stride; }
-    U8 *row(int y)                      { return pixels + y * stride; }
+    U8 *row(int y)                      { if (readonly) write_denied(); return pixels + y * stride; }
 
     const U8 *ptr(int x, int y) const   { return pixels + y * stride + x; }
-    U8 *ptr(int x, int y)               { return pixels + y * stride + x; }
+    U8 *ptr(int x, int y)               { if (readonly) write_denied(); return pixels + y * stride + x; }
 
     operator void *() const     { return buf ? buf : nullptr; }
     int width() const           { return w; }
     int height() const          { return h; }
 };
 
+PixelSlice crop_to_opaque(const PixelSlice &img, int *x0, int *y0); // smallest copy holding all nonzero pixels
+
+class Sprite { // image reduced to its opaque (nonzero) pixels, for repeated blits
+    struct Span {
+        U16 x, len;
+    };
+
+    PixelSlice pixels;          // cropped to the bounding box
+    int x0, y0;                 // where pixels sit in the source image
+    int srcw, srch;             // source image size; flips mirror about its width
+    std::vector<Span> spans;    // opaque runs, row by row
+    std::vector<U32> rows;      // row y has spans[rows[y]] .. spans[rows[y+1]-1]
+
+    mutable std::shared_ptr<Sprite> shrunk_cache[2][2][2]; // [filtered][shrink 2, 4][flipX], built on first use
+    mutable U32 filtered_generation; // blend_generation the filtered copies are for
+    const Sprite &shrunk(int shrink, bool flipX, bool filtered) const;
+public:
+    Sprite();
+    explicit Sprite(const PixelSlice &img);
+
+    // same results as blit_transparent_shrink / blit_to_mask on the source image,
+    // unless set_filtered_shrink is on
+    void blit(PixelSlice &dest, int dx, int dy, int shrink=1, bool flipX=false) const;
+    void blit_remapped(PixelSlice &dest, int dx, int dy, const U8 *map, int shrink=1, bool flipX=false) const; // pixels go through map[256]
+    void blit_mask(PixelSlice &dest, U8 color, int dx, int dy, bool flipX) const;
+
+    operator void *() const     { return pixels; }
+};
+
 void solid_fill(PixelSlice &dest, int color);
 void blit(PixelSlice &dest, int dx, int dy, const PixelSlice &src);
 void blit_transparent(PixelSlice &dest, int dx, int dy, const PixelSlice &src);
 void blit_transparent_shrink(PixelSlice &dest, int dx, int dy, const PixelSlice &src, int shrink, bool flipX);
 void blit_to_mask(PixelSlice &dest, U8 color, int dx, int dy, const PixelSlice &src, bool flipX);
+void blit_delta_transparent(PixelSlice &dest, int dx, int dy, const Slice &data, int shrink, bool flipX); // decodes on the fly
+
+// Blending through lookup tables built from palette_a, on first use and
+// again once palette_a has changed other than by a color cycle. Tables stay
+// valid until then; amounts are out of 256. Main thread only.
+const U8 *blend_half_table(); // [src*256 + dst]: 50/50 mix
+const U8 *blend_shade_map(int amount); // [dst] darkened by amount
+const U8 *blend_tint_map(U8 color, int amount); // [dst] moved amount of the way towards color
+void blit_translucent(PixelSlice &dest, int dx, int dy, const PixelSlice &src); // nonzero src pixels mixed 50/50 into dest
+void blit_shadow(PixelSlice &dest, int dx, int dy, const PixelSlice &mask, int amount); // darkens dest under nonzero mask pixels
+void remap_pixels(PixelSlice &dest, const U8 *map); // every pixel through map[256], e.g. to fade or tint a region
+const U8 *inverse_palette(); // closest color but 0 to 6-bit r,g,b, see build_inverse_palette
+U32 blend_generation(); // changes whenever the tables are rebuilt for a new palette
+
+// Sprites drawn at shrink 2 and 4 normally keep every shrink'th pixel.
+// Filtered, each block of pixels becomes its average color instead, opaque
+// if at least half of it is; sprites rebuild their copies after palette
+// changes other than color cycling. Only Sprite::blit filters: the one-off
+// blit_gra_item and blit_delta_transparent keep sampling.
+void set_filtered_shrink(bool on);
 
 class Animation { // abstract interface
 public:
@@ -87,12 +146,26 @@ PixelSlice load_rle_pixels(const Slice &data, int w, int h);
 PixelSlice load_rle_with_header(const Slice &data);
 PixelSlice load_hot(const Slice &data);
 PixelSlice load_delta_pixels(const Slice &data);
+PixelSlice load_gra_item(const GraArchive &lib, const GraArchive::Item *item); // delta or RLE item
+Sprite load_gra_sprite(const GraArchive &lib, const GraArchive::Item *item); // decodes into scratch memory
+void blit_gra_item(PixelSlice &dest, int dx, int dy, const GraArchive &lib, const GraArchive::Item *item, int shrink, bool flipX);
 
 void set_palette();
 void set_palb_fade(int intensity);
 void load_palette(const Str &filename);
 void load_background(const Str &filename, int screen=0); // 0=VGA, 1..4=scroll screen
 
+// Images decoded ahead of time (e.g. by a room transition on a worker thread),
+// keyed by normalized file name. load_background picks them up from the set
+// installed with set_predecoded_images instead of decoding again. Files that
+// are missing or corrupt are left out rather than reported.
+typedef std::unordered_map<Str, PixelSlice> ImageMap;
+
+void predecode_background(const Str &filename, ImageMap *images); // any thread
+void predecode_hotmap(const Str &filename, ImageMap *images); // any thread
+void set_predecoded_images(const ImageMap &images); // main thread
+PixelSlice find_predecoded_image(const Str &filename); // empty if not predecoded
+
 // big anim flags
 enum {
     BA_REVERSE      = 1,
@@ -102,6 +175,7 @@ enum {
 
 Animation *new_color_cycle_anim(int first, int last, int delay, int dir);
 Animation *new_big_anim(const Str &filename, int flags);
+void set_big_anim_budget(U32 bytes); // frame memory per RLE animation; bigger ones keep keyframes and decode on demand
 Animation *new_mega_anim(const Str &grafilename, const Str &prefix, int first_frame,
     int last_frame, int posx, int posy, int delay, int scale, int flip);
 
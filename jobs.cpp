@@ -0,0 +1,142 @@
+#include "jobs.h"
+#include "common.h"
+#include <thread>
+#include <deque>
+#include <vector>
+
+namespace {
+    struct Job {
+        std::function<void()> fn;
+        JobGroup *group;
+    };
+}
+
+static std::mutex s_mutex;
+static std::condition_variable s_wake;
+static std::deque<Job> s_queue;
+static std::deque<Job> s_background; // taken only when s_queue is empty
+static std::vector<std::thread> s_workers;
+static bool s_quit;
+
+// takes a job off queue if there is one, only one of group's if given
+// (s_mutex must be held)
+static bool pop_job(std::deque<Job> &queue, Job *job, JobGroup *group=0)
+{
+    for (std::deque<Job>::iterator it=queue.begin(); it != queue.end(); ++it) {
+        if (group && it->group != group)
+            continue;
+
+        *job = *it;
+        queue.erase(it);
+        return true;
+    }
+    return false;
+}
+
+static void worker_main()
+{
+    std::unique_lock<std::mutex> lock(s_mutex);
+    for (;;) {
+        Job job;
+        if (pop_job(s_queue, &job) || pop_job(s_background, &job)) {
+            lock.unlock();
+            job.fn();
+            job.group->finish_one();
+            lock.lock();
+        } else if (s_quit)
+            break;
+        else
+            s_wake.wait(lock);
+    }
+}
+
+void jobs_init(int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = MAX((int)std::thread::hardware_concurrency() - 1, 1);
+
+    s_quit = false;
+    for (int i=0; i < nthreads; i++)
+        s_workers.push_back(std::thread(worker_main));
+}
+
+void jobs_shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        s_quit = true;
+    }
+    s_wake.notify_all();
+
+    for (size_t i=0; i < s_workers.size(); i++)
+        s_workers[i].join();
+    s_workers.clear();
+}
+
+JobGroup::JobGroup(bool background)
+    : pending(0), background(background)
+{
+}
+
+JobGroup::~JobGroup()
+{
+    wait();
+}
+
+void JobGroup::finish_one()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0)
+        cond.notify_all();
+}
+
+void JobGroup::run(const std::function<void()> &fn)
+{
+    if (s_workers.empty()) {
+        fn();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+
+    Job job;
+    job.fn = fn;
+    job.group = this;
+    {
+        std::lock_guard<std::mutex> lock(s_mutex);
+        (background ? s_background : s_queue).push_back(job);
+    }
+    s_wake.notify_one();
+}
+
+void JobGroup::wait()
+{
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending)
+                return;
+        }
+
+        // rather than block, run our own queued jobs; other groups' jobs
+        // could take arbitrarily long and are the workers' business
+        Job job;
+        bool got_job;
+        {
+            std::lock_guard<std::mutex> lock(s_mutex);
+            got_job = pop_job(background ? s_background : s_queue, &job, this);
+        }
+
+        if (got_job) {
+            job.fn();
+            job.group->finish_one();
+        } else { // the rest of our jobs are running on workers, just wait for them
+            std::unique_lock<std::mutex> lock(mutex);
+            while (pending)
+                cond.wait(lock);
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+// Small worker thread pool for loading and decoding work.
+void jobs_init(int nthreads=0); // 0 = one per core besides the main thread
+void jobs_shutdown();
+
+class JobGroup { // set of jobs that can be waited on together
+    std::mutex mutex;
+    std::condition_variable cond;
+    int pending;
+    bool background;
+
+    JobGroup(const JobGroup &);
+    JobGroup &operator =(const JobGroup &);
+
+public:
+    explicit JobGroup(bool background=false); // background jobs only start when no other job is queued
+    ~JobGroup(); // waits for all jobs
+
+    void run(const std::function<void()> &fn); // runs inline if there are no workers
+    void wait(); // runs our own queued jobs while waiting
+
+    void finish_one(); // internal: one of our jobs completed
+};
+
+#endif
@@ -13,6 +13,11 @@
 #include "script.h"
 #include "mouse.h"
 #include "corridor.h"
+#include "bundle.h"
+#include "jobs.h"
+#include "diskcache.h"
+#include "manifest.h"
+#include "pool.h"
 #include "str.h"
 
 #pragma comment(lib, "winmm.lib")
@@ -101,6 +106,16 @@ static void paint(HWND hwnd, HDC hdc)
     FillRect(hdc, &r, black);
 }
 
+// ---- asset setup
+
+static const char *asset_dirs[] = { "data", "grafix", "chars" };
+
+static void mount_assets(const char *root)
+{
+    for (int i=0; i < ARRAY_COUNT(asset_dirs); i++)
+        vfs_mount(root, asset_dirs[i]);
+}
+
 // ---- windows blurb
 
 static LRESULT CALLBACK windowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
@@ -189,6 +204,13 @@ static void init()
     timeBeginPeriod(1);
     srand(timeGetTime());
 
+#ifdef _DEBUG
+    pool_self_check(); // before any other thread allocates
+#endif
+    jobs_init();
+    bundle_open("vision1.bdl");
+    manifest_load("vision1.man");
+    diskcache_init("cache");
     graphics_init();
     vars_init();
     font_init();
@@ -203,7 +225,15 @@ static void shutdown()
     mouse_shutdown();
     graphics_shutdown();
     corridor_shutdown();
+    gra_shutdown();
 
+#ifdef _DEBUG
+    asset_cache_dump_stats();
+    pool_dump_stats();
+#endif
+    manifest_shutdown();
+    bundle_close();
+    jobs_shutdown();
     timeEndPeriod(1);
 }
 
@@ -251,6 +281,42 @@ int main(int argc, char **argv)
     //_CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_CHECK_ALWAYS_DF | _CRTDBG_CHECK_CRT_DF | _CRTDBG_LEAK_CHECK_DF);
 #endif
 
+    // "-benchscan <dir>" runs scan_benchmark on the scripts under dir/data
+    if (argc == 3 && !strcmp(argv[1], "-benchscan")) {
+        mount_assets(argv[2]);
+        scan_benchmark();
+        return 0;
+    }
+
+    // "-overlay <dir>" (repeatable) lets dir/data etc. override the stock files
+    // "-anibudget <kb>" sets how much decoded frame data an animation may keep
+    // "-filter" averages sprites and faces drawn shrunk instead of sampling them
+    // "-textshade <amount>" darkens the band behind printed text and shadows the glyphs, amount out of 256
+    mount_assets(".");
+    for (int i=1; i < argc; i++) {
+        if (!strcmp(argv[i], "-filter"))
+            set_filtered_shrink(true);
+        else if (i + 1 >= argc)
+            break;
+        else if (!strcmp(argv[i], "-overlay"))
+            mount_assets(argv[++i]);
+        else if (!strcmp(argv[i], "-anibudget"))
+            set_big_anim_budget(atoi(argv[++i]) * 1024);
+        else if (!strcmp(argv[i], "-textshade"))
+            game_set_text_shade(atoi(argv[++i]));
+    }
+    // "-bundle <listfile> <outfile>" builds an asset bundle, "-bundlepix" also pre-decodes .gra items
+    if (argc == 4 && (!strcmp(argv[1], "-bundle") || !strcmp(argv[1], "-bundlepix"))) {
+        bundle_build(argv[3], argv[2], !strcmp(argv[1], "-bundlepix"));
+        return 0;
+    }
+
+    // "-manifest <outfile> [<listfile>]" scans the room scripts for preloading, optionally writing a bundle list
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "-manifest")) {
+        manifest_build(argv[2], (argc == 4) ? argv[3] : "");
+        return 0;
+    }
+
     init();
 
     HINSTANCE hInstance = GetModuleHandle(NULL);
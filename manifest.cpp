@@ -0,0 +1,126 @@
+#include "manifest.h"
+#include "script.h"
+#include "util.h"
+#include "str.h"
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+// ---- room table
+
+namespace {
+    struct Room {
+        std::vector<Str> files;
+        std::vector<Str> exits;
+    };
+}
+
+static std::unordered_map<Str, Room> s_rooms;
+
+static Str room_script(const Str &room)
+{
+    return "data/" + room + ".par";
+}
+
+static void add_unique(std::vector<Str> *list, const Str &name)
+{
+    if (std::find(list->begin(), list->end(), name) == list->end())
+        list->push_back(name);
+}
+
+// ---- building
+
+void manifest_build(const Str &outname, const Str &listname)
+{
+    std::vector<Str> scripts;
+    vfs_list(&scripts, "data", ".par");
+
+    Str manifest = "; room manifest - generated by \"vision1 -manifest\", don't edit\n";
+    std::vector<Str> order;
+
+    for (size_t i=0; i < scripts.size(); i++) {
+        const Str &script = scripts[i];
+        Str room = script.substr(5, script.size() - 9); // strip "data/" and ".par"
+
+        std::vector<Str> files, exits;
+        script_scan_refs(read_xored(script), &files, &exits);
+
+        manifest += "room " + room + "\n";
+        add_unique(&order, script);
+        for (size_t j=0; j < files.size(); j++) {
+            manifest += "file " + files[j] + "\n";
+            add_unique(&order, files[j]);
+        }
+        for (size_t j=0; j < exits.size(); j++)
+            manifest += "exit " + exits[j] + "\n";
+    }
+
+    write_file(outname, manifest.c_str(), manifest.size());
+    printf("manifest: wrote %d rooms to %s\n", (int) scripts.size(), outname.c_str());
+
+    if (!listname.empty()) {
+        Str list;
+        for (size_t i=0; i < order.size(); i++)
+            list += order[i] + "\n";
+        write_file(listname, list.c_str(), list.size());
+    }
+}
+
+// ---- loading
+
+void manifest_load(const Str &filename)
+{
+    s_rooms.clear();
+
+    Slice text = try_read_file(filename);
+    Room *cur = 0;
+    while (text.len()) {
+        Slice line = eat_heading_space(chop_line(text));
+        if (!line.len() || line[0] == ';')
+            continue;
+
+        Str key = to_string(chop_until(line, ' '));
+        Str value = to_string(eat_heading_space(line));
+        if (key == "room")
+            cur = &s_rooms[tolower(value)];
+        else if (cur && key == "file")
+            cur->files.push_back(value);
+        else if (cur && key == "exit")
+            cur->exits.push_back(tolower(value));
+        else
+            panic("%s: bad line \"%s %s\"", filename.c_str(), key.c_str(), value.c_str());
+    }
+}
+
+void manifest_shutdown()
+{
+    s_rooms.clear();
+}
+
+// ---- prefetching
+
+void manifest_prefetch_neighbours(const Str &room)
+{
+    auto it = s_rooms.find(tolower(room));
+    if (it == s_rooms.end())
+        return;
+
+    // the neighbours' assets; the room's own are loaded by now
+    const std::vector<Str> &own = it->second.files;
+    const std::vector<Str> &exits = it->second.exits;
+    std::vector<Str> files;
+    for (size_t i=0; i < exits.size(); i++) {
+        if (exits[i] == it->first)
+            continue;
+        add_unique(&files, room_script(exits[i]));
+
+        auto next = s_rooms.find(exits[i]);
+        if (next != s_rooms.end())
+            for (size_t j=0; j < next->second.files.size(); j++)
+                if (std::find(own.begin(), own.end(), next->second.files[j]) == own.end())
+                    add_unique(&files, next->second.files[j]);
+    }
+
+    prefetch_files(files);
+}
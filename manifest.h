@@ -0,0 +1,15 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+class Str;
+
+// Per-room asset manifest: for every data/*.par, the files the script loads
+// and the rooms it can lead to. Built offline by scanning the scripts; at run
+// time, entering a room starts loading everything its neighbours need.
+void manifest_build(const Str &outname, const Str &listname); // listname (optional) gets a bundle list in room order
+void manifest_load(const Str &filename); // missing file = no prefetching
+void manifest_shutdown();
+
+void manifest_prefetch_neighbours(const Str &room); // returns immediately
+
+#endif
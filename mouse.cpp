@@ -71,23 +71,24 @@ MouseCursor get_mouse_cursor_from_char(char ch)
 void mouse_init()
 {
     set_mouse_cursor(MC_NORMAL);
-    Slice gfx = read_file("grafix/pointers.gra");
+    std::shared_ptr<const GraArchive> lib = read_gra("grafix/pointers.gra");
+    const GraArchive &gfx = *lib;
 
     for (int i=0; i < ARRAY_COUNT(cursor_desc); i++) {
         PixelSlice img = PixelSlice::black(16, 16);
 
         if (cursor_desc[i].filename) {
-            U8 type;
-            int offs = find_gra_item(gfx, cursor_desc[i].filename, &type);
-            if (offs == -1 || type != 5)
+            const GraArchive::Item *item = gfx.find(cursor_desc[i].filename);
+            if (!item || item->type != 5)
                 panic("error finding cursor image '%s'\n", cursor_desc[i].filename);
 
-            img = load_delta_pixels(gfx(offs));
+            img = load_gra_item(gfx, item);
         }
 
+        const PixelSlice &src = img;
         CursorImg &cursor = cursors[i];
         for (int y=0; y < 16; y++)
-            memcpy(cursor.img[y], img.ptr(0, y), 16);
+            memcpy(cursor.img[y], src.ptr(0, y), 16);
         cursor.hotx = cursor_desc[i].hotx;
         cursor.hoty = cursor_desc[i].hoty;
     }
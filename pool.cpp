@@ -0,0 +1,379 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// ---- locks
+
+namespace {
+    // Strings allocate from the pools during static construction and
+    // destruction, when a std::mutex may not exist yet (or any more). A
+    // zero-initialized atomic always does, and the locks are only held
+    // for a few instructions anyway.
+    struct SpinLock {
+        std::atomic<U32> busy;
+
+        void lock()     { while (busy.exchange(1, std::memory_order_acquire)) std::this_thread::yield(); }
+        void unlock()   { busy.store(0, std::memory_order_release); }
+    };
+}
+
+// ---- size classes
+
+namespace {
+    struct BlockHeader {
+        U32 size_class;     // LARGE_BLOCK if it came straight from malloc
+        U32 size;           // usable bytes
+        U32 pad[2];         // keeps the data as aligned as malloc's
+    };
+
+    struct SizeClass {
+        SpinLock lock;
+        BlockHeader *free_list; // linked through the first word of the data
+        U32 nfree;
+    };
+}
+
+static const int MIN_SHIFT = 5;     // smallest class: 32 bytes
+static const int MAX_SHIFT = 20;    // blocks over 1MB aren't pooled
+static const int STEPS = 4;         // classes per power of two
+static const int NUM_CLASSES = 1 + (MAX_SHIFT - MIN_SHIFT) * STEPS;
+static const U32 LARGE_BLOCK = ~0u;
+static const U32 KEEP_BYTES = 2*1024*1024; // most each free list holds on to
+
+static SizeClass s_classes[NUM_CLASSES];
+static std::atomic<U32> s_system_allocs;
+static std::atomic<U32> s_bytes_reserved;
+
+static int highest_bit(U32 x) // x != 0
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse(&i, x);
+    return (int) i;
+#else
+    return 31 - __builtin_clz(x);
+#endif
+}
+
+static int size_class(U32 nbytes) // nbytes <= 1 << MAX_SHIFT
+{
+    if (nbytes <= (1u << MIN_SHIFT))
+        return 0;
+
+    int shift = highest_bit(nbytes - 1);
+    int step = (int) ((nbytes - 1) >> (shift - 2)) & (STEPS - 1);
+    return 1 + (shift - MIN_SHIFT) * STEPS + step;
+}
+
+static U32 class_size(int c)
+{
+    if (c == 0)
+        return 1u << MIN_SHIFT;
+
+    int shift = MIN_SHIFT + (c - 1) / STEPS;
+    return (1u << shift) + (U32) ((c - 1) % STEPS + 1) * (1u << (shift - 2));
+}
+
+static BlockHeader *&next_free(BlockHeader *h)
+{
+    return *(BlockHeader **) (h + 1);
+}
+
+void *pool_alloc(U32 nbytes)
+{
+    int c = (nbytes <= (1u << MAX_SHIFT)) ? size_class(nbytes) : -1;
+    if (c >= 0) {
+        SizeClass &sc = s_classes[c];
+        std::lock_guard<SpinLock> lock(sc.lock);
+        BlockHeader *h = sc.free_list;
+        if (h) {
+            sc.free_list = next_free(h);
+            sc.nfree--;
+            return h + 1;
+        }
+    }
+
+    U32 size = (c >= 0) ? class_size(c) : nbytes;
+    BlockHeader *h = (BlockHeader *) malloc(sizeof(BlockHeader) + size);
+    if (!h)
+        panic("out of memory");
+
+    h->size_class = (c >= 0) ? (U32) c : LARGE_BLOCK;
+    h->size = size;
+    s_system_allocs++;
+    s_bytes_reserved += size;
+    return h + 1;
+}
+
+void *pool_realloc(void *p, U32 nbytes)
+{
+    if (!p)
+        return pool_alloc(nbytes);
+
+    BlockHeader *h = (BlockHeader *) p - 1;
+    if (nbytes <= h->size)
+        return p;
+
+    void *q = pool_alloc(nbytes);
+    memcpy(q, p, h->size);
+    pool_free(p);
+    return q;
+}
+
+void pool_free(void *p)
+{
+    if (!p)
+        return;
+
+    BlockHeader *h = (BlockHeader *) p - 1;
+    if (h->size_class != LARGE_BLOCK) {
+        SizeClass &sc = s_classes[h->size_class];
+        std::lock_guard<SpinLock> lock(sc.lock);
+        if (sc.nfree < 4 || (sc.nfree + 1) * h->size <= KEEP_BYTES) {
+            next_free(h) = sc.free_list;
+            sc.free_list = h;
+            sc.nfree++;
+            return;
+        }
+    }
+
+    s_bytes_reserved -= h->size;
+    free(h);
+}
+
+// ---- scratch arena
+
+static SpinLock s_scratch_lock;
+static U8 *s_scratch;               // arena block
+static U32 s_scratch_size;
+static U32 s_scratch_used;
+static U32 s_scratch_spilled;       // bytes that didn't fit and went to the pools instead
+static U32 s_scratch_live;          // allocations not freed yet
+static U32 s_scratch_peak;          // most bytes in use at once since the last end of frame
+
+static bool in_scratch(const void *p)
+{
+    return p >= s_scratch && p < s_scratch + s_scratch_size;
+}
+
+void *scratch_alloc(U32 nbytes)
+{
+    nbytes = (nbytes + 15) & ~15u;
+
+    std::lock_guard<SpinLock> lock(s_scratch_lock);
+    s_scratch_live++;
+    s_scratch_peak = std::max(s_scratch_peak, s_scratch_used + s_scratch_spilled + nbytes);
+    if (nbytes <= s_scratch_size - s_scratch_used) {
+        void *p = s_scratch + s_scratch_used;
+        s_scratch_used += nbytes;
+        return p;
+    }
+
+    s_scratch_spilled += nbytes;
+    return pool_alloc(nbytes);
+}
+
+void scratch_free(void *p)
+{
+    if (!p)
+        return;
+
+    std::lock_guard<SpinLock> lock(s_scratch_lock);
+    assert(s_scratch_live);
+    if (!in_scratch(p))
+        pool_free(p);
+
+    if (--s_scratch_live == 0) {
+        s_scratch_used = 0;
+        s_scratch_spilled = 0;
+    }
+}
+
+void scratch_end_frame()
+{
+    std::lock_guard<SpinLock> lock(s_scratch_lock);
+
+    // temporaries that outlive their frame just keep the arena from
+    // rewinding until they're gone
+    if (s_scratch_live)
+        return;
+
+    if (s_scratch_peak > s_scratch_size) {
+        free(s_scratch);
+        s_scratch_size = (s_scratch_peak + 0xffff) & ~0xffffu;
+        s_scratch = (U8 *) malloc(s_scratch_size);
+        if (!s_scratch)
+            panic("out of memory");
+        s_system_allocs++;
+    }
+    s_scratch_peak = 0;
+}
+
+// ---- stats
+
+PoolStats pool_get_stats()
+{
+    PoolStats st;
+    st.system_allocs = s_system_allocs;
+    st.bytes_reserved = s_bytes_reserved;
+    st.scratch_size = s_scratch_size;
+    return st;
+}
+
+void pool_dump_stats()
+{
+    PoolStats st = pool_get_stats();
+    printf("pools: %u system allocations, %u bytes reserved, %u byte scratch arena\n",
+        st.system_allocs, st.bytes_reserved, st.scratch_size);
+}
+
+// ---- self check
+
+namespace {
+    struct CheckBlock {
+        U8 *p;
+        U32 size;
+        U8 fill;    // every byte of the block
+    };
+}
+
+static const int CHECK_THREADS = 4;
+static const int CHECK_WINDOW = 64; // live pool blocks per thread
+static const U32 CHECK_MAX_SIZE = 4096;
+
+static U32 check_rand(U32 *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+static void check_fill(CheckBlock &b, U8 fill)
+{
+    b.fill = fill;
+    memset(b.p, fill, b.size);
+}
+
+// a block handed out twice, or written past its end, shows up here
+static void check_block(const CheckBlock &b, const char *what)
+{
+    for (U32 i=0; i < b.size; i++)
+        if (b.p[i] != b.fill)
+            panic("pool self check: %s block %p overwritten at +%u", what, b.p, i);
+}
+
+// keeps a window of live blocks, freeing, allocating and growing them at random
+static void check_pools(U32 seed, int rounds, U32 max_size)
+{
+    CheckBlock live[CHECK_WINDOW];
+    U32 state = seed;
+    for (int i=0; i < CHECK_WINDOW; i++) {
+        live[i].size = 1 + check_rand(&state) % max_size;
+        live[i].p = (U8 *) pool_alloc(live[i].size);
+        check_fill(live[i], (U8) check_rand(&state));
+    }
+
+    for (int r=0; r < rounds; r++) {
+        CheckBlock &b = live[check_rand(&state) % CHECK_WINDOW];
+        check_block(b, "pool");
+        if (check_rand(&state) % 4 == 0 && b.size < max_size) {
+            U32 size = b.size + 1 + check_rand(&state) % max_size;
+            b.p = (U8 *) pool_realloc(b.p, size);
+            check_block(b, "reallocated");
+            b.size = size;
+        } else {
+            pool_free(b.p);
+            b.size = 1 + check_rand(&state) % max_size;
+            b.p = (U8 *) pool_alloc(b.size);
+        }
+        check_fill(b, (U8) check_rand(&state));
+    }
+
+    for (int i=0; i < CHECK_WINDOW; i++) {
+        check_block(live[i], "pool");
+        pool_free(live[i].p);
+    }
+}
+
+// a few temporaries at a time, like a decode job
+static void check_scratch(U32 seed, int rounds, bool must_fit)
+{
+    U32 state = seed;
+    for (int r=0; r < rounds; r++) {
+        CheckBlock temps[4];
+        for (int i=0; i < 4; i++) {
+            temps[i].size = 1 + check_rand(&state) % CHECK_MAX_SIZE;
+            temps[i].p = (U8 *) scratch_alloc(temps[i].size);
+            if (must_fit && !in_scratch(temps[i].p))
+                panic("pool self check: scratch arena spilled after growing to the peak");
+            check_fill(temps[i], (U8) check_rand(&state));
+        }
+        for (int i=0; i < 4; i++) {
+            check_block(temps[i], "scratch");
+            scratch_free(temps[i].p);
+        }
+    }
+}
+
+// small blocks, so the threads keep fighting over the same few free lists
+static void check_pools_thread(U32 seed, int rounds)
+{
+    check_pools(seed, rounds, 256);
+}
+
+static void check_scratch_thread(U32 seed, int rounds)
+{
+    check_scratch(seed, rounds, false);
+}
+
+static void check_threads(void (*fn)(U32, int), U32 seed, int rounds)
+{
+    std::vector<std::thread> threads;
+    for (int i=0; i < CHECK_THREADS; i++)
+        threads.push_back(std::thread(fn, seed + i, rounds));
+    for (size_t i=0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+void pool_self_check()
+{
+    if (s_scratch_live)
+        panic("pool self check: scratch memory is in use");
+
+    check_threads(check_pools_thread, 1000, 50000);
+
+    // the arena only rewinds once nothing in it is alive, so run it in
+    // frames the way the game does
+    for (int frame=0; frame < 50; frame++) {
+        check_threads(check_scratch_thread, 2000 + frame * CHECK_THREADS, 20);
+        scratch_end_frame();
+    }
+
+    // once warm, the same single-threaded load runs off the free lists
+    check_pools(1, 2000, CHECK_MAX_SIZE);
+    U32 before = s_system_allocs;
+    check_pools(1, 2000, CHECK_MAX_SIZE);
+    if (s_system_allocs != before)
+        panic("pool self check: %u system allocations after warm-up", s_system_allocs - before);
+
+    // with nothing alive the arena has rewound, and after the end of the
+    // frame it holds the threads' peak, so one thread's load fits in it
+    scratch_end_frame();
+    void *first = scratch_alloc(1);
+    scratch_free(first);
+    check_scratch(1, 20, true);
+    void *again = scratch_alloc(1);
+    scratch_free(again);
+    if (first != s_scratch || again != s_scratch)
+        panic("pool self check: scratch arena didn't rewind");
+}
@@ -0,0 +1,34 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "common.h"
+
+// Block allocator behind slices, pixel buffers and strings. Sizes up to 1MB
+// are rounded up to classes (four per power of two) and freed blocks go onto
+// a free list per class, so once the working set is warm those buffers stop
+// reaching the system allocator. Bigger blocks come straight from malloc, and
+// anything made with plain new (containers, shared_ptr, Sprite) isn't pooled.
+// Any thread.
+void *pool_alloc(U32 nbytes); // panics when out of memory
+void *pool_realloc(void *p, U32 nbytes);
+void pool_free(void *p); // p may be 0
+
+// Scratch arena for temporaries that are gone by the end of the frame:
+// allocating bumps a pointer, freeing only counts down, and the arena rewinds
+// whenever nothing in it is alive. game_frame calls scratch_end_frame, which
+// grows the arena to the frame's peak so the next one fits in a single block.
+void *scratch_alloc(U32 nbytes);
+void scratch_free(void *p); // p may be 0
+void scratch_end_frame();
+
+struct PoolStats {
+    U32 system_allocs;  // blocks fetched from malloc, ever
+    U32 bytes_reserved; // held by the pools, in use or on free lists
+    U32 scratch_size;   // scratch arena block
+};
+
+PoolStats pool_get_stats();
+void pool_dump_stats(); // debug
+void pool_self_check(); // debug: hammers the pools and the scratch arena from several threads; panics if anything's off
+
+#endif
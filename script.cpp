@@ -8,10 +8,19 @@
 #include "mouse.h"
 #include "font.h"
 #include "corridor.h"
+#include "manifest.h"
+#include "jobs.h"
+#include "simd.h"
+#include "pool.h"
 #include <assert.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
 // ---- game flow vars
 
@@ -115,7 +124,7 @@ static void scroll_enable()
     if (scroll_window)
         return;
 
-    scroll_window = PixelSlice::make(SCROLL_WINDOW_WIDTH, vga_screen.height());
+    scroll_window = PixelSlice::make_aligned(SCROLL_WINDOW_WIDTH, vga_screen.height());
 }
 
 static void scroll_tick()
@@ -148,6 +157,7 @@ static PixelSlice scroll_getscreen()
 
 static PixelSlice print_saveunder;
 static int print_savey;
+static int s_text_shade; // out of 256, 0 for plain text
 static const int CENTERED = -1;
 
 static void print_clear()
@@ -180,18 +190,12 @@ static void print_getsize(int *w, int *h, const char *str)
     }
 }
 
-static void print_text_impl(int x, int y, int h, const char *str)
+static void print_lines(PixelSlice &dest, int x, int y, const char *str)
 {
-    print_clear();
-
-    PixelSlice screen = scroll_getscreen();
-    print_savey = y;
-    print_saveunder = screen.slice(0, y, vga_screen.width(), y + h).clone();
-
     while (*str) {
         int len = print_getlinelen(str);
         int w = bigfont->str_width(str, len);
-        bigfont->print(screen, (x == CENTERED) ? (320 - w) / 2 : x, y, str, len);
+        bigfont->print(dest, (x == CENTERED) ? (320 - w) / 2 : x, y, str, len);
 
         y += 10;
         str += len;
@@ -200,6 +204,26 @@ static void print_text_impl(int x, int y, int h, const char *str)
     }
 }
 
+static void print_text_impl(int x, int y, int h, const char *str)
+{
+    print_clear();
+
+    PixelSlice screen = scroll_getscreen();
+    PixelSlice band = screen.slice(0, y, vga_screen.width(), y + h);
+    print_savey = y;
+    print_saveunder = band.clone();
+
+    if (s_text_shade) {
+        // dim the band, then drop a shadow one pixel down-right of the glyphs
+        PixelSlice glyphs = PixelSlice::make_scratch(band.width(), band.height());
+        solid_fill(glyphs, 0);
+        print_lines(glyphs, x, 0, str);
+        remap_pixels(band, blend_shade_map(s_text_shade / 2));
+        blit_shadow(band, 1, 1, glyphs, s_text_shade);
+    }
+    print_lines(screen, x, y, str);
+}
+
 static void print_text_at(int x, int y, const char *str)
 {
     int w, h;
@@ -220,7 +244,9 @@ static PixelSlice hotspots;
 
 static void hotspot_load(const char *filename, int screen)
 {
-    PixelSlice img = load_hot(read_file(filename));
+    PixelSlice img = find_predecoded_image(filename);
+    if (!img)
+        img = load_hot(read_file(filename));
     img = img.slice(0, SCROLL_WINDOW_Y0/2, img.width(), SCROLL_WINDOW_Y1/2);
 
     // save it!
@@ -297,26 +323,36 @@ static void scan_line()
     line = chop_line(scan);
 }
 
-static void skip_whitespace()
+// the versions taking a line don't touch the scanner state
+static void skip_whitespace(Slice &l)
 {
-    line = eat_heading_space(line);
+    l = eat_heading_space(l);
     // an end-of-line comment starts with ; and counts as white space
-    if (line.len() && line[0] == ';')
-        line = line(line.len());
+    if (l.len() && l[0] == ';')
+        l = l(l.len());
 }
 
-static Slice scan_word()
+static void skip_whitespace()
 {
-    U32 pos = 0;
-    while (pos < line.len() && line[pos] != ' ' && line[pos] != ';')
-        pos++;
+    skip_whitespace(line);
+}
 
-    Slice s = line(0, pos);
-    line = line(pos);
-    skip_whitespace();
+static Slice scan_word(Slice &l)
+{
+    const U8 *start = &l[0];
+    U32 pos = (U32) (find_any_byte(start, start + l.len(), " ;") - start);
+
+    Slice s = l(0, pos);
+    l = l(pos);
+    skip_whitespace(l);
     return s;
 }
 
+static Slice scan_word()
+{
+    return scan_word(line);
+}
+
 // ---- debug
 
 static void print(Slice s)
@@ -412,27 +448,19 @@ static Str unquoted_str_value_word()
 
 static bool has_prefixi(const Slice &value, const char *str)
 {
-    U32 pos = 0;
-    while (pos < value.len() && str[pos] && tolower(value[pos]) == str[pos])
-        pos++;
-    return str[pos] == 0;
+    U32 len = (U32) strlen(str);
+    return len <= value.len() && equal_nocase(&value[0], (const U8 *) str, len);
 }
 
 static bool is_equal(const Slice &value, const char *str)
 {
-    return has_prefixi(value, str) && str[value.len()] == 0;
+    U32 len = (U32) strlen(str);
+    return len == value.len() && equal_nocase(&value[0], (const U8 *) str, len);
 }
 
 static bool is_equal(const Slice &a, const Slice &b)
 {
-    if (a.len() != b.len())
-        return false;
-
-    for (U32 pos=0; pos < a.len(); pos++)
-        if (tolower(a[pos]) != tolower(b[pos]))
-            return false;
-
-    return true;
+    return a.len() == b.len() && equal_nocase(&a[0], &b[0], a.len());
 }
 
 // ---- boolean expressions
@@ -447,17 +475,15 @@ static Slice scan_bool_tok()
     U32 pos = 0;
 
     if (line.len() && line[0] == '\'') { // string
-        pos++;
-        while (pos < line.len() && line[pos] != '\'')
-            pos++;
-
+        const U8 *start = &line[0];
+        pos = (U32) (find_byte(start + 1, start + line.len(), '\'') - start);
         if (pos == line.len())
             panic("string continued past end of line");
         else
             pos++; // quote is part of the string!
     } else {
-        while (pos < line.len() && line[pos] != ' ' && line[pos] != ';' && !is_bool_expr_op(line[pos]))
-            pos++;
+        const U8 *start = &line[0];
+        pos = (U32) (find_any_byte(start, start + line.len(), " ;^<=>#") - start);
     }
 
     // handle single-character tokens
@@ -706,12 +732,17 @@ static void cmd_song()
     // just ignored for now
 }
 
+static void prepare_next_room();
+
 static void cmd_fade()
 {
     Slice dir = scan_word();
     int duration = int_value_word();
     duration = duration * 7; // is in tenths of seconds, want 70fps steps
 
+    if (is_equal(dir, "out"))
+        prepare_next_room(); // load while we fade
+
     if (is_equal(dir, "in")) {
         for (int i=1; i <= duration; i++) {
             set_palb_fade(256 * i / duration);
@@ -1095,6 +1126,19 @@ static struct CommandDesc
     "xor",          2,  false,  cmd_xor,
 };
 
+static int find_command(const Slice &command)
+{
+    int i;
+    for (i=0; i < ARRAY_COUNT(commands); i++) {
+        int j=0;
+        while (j < commands[i].prefixlen && tolower(command[j]) == commands[i].name[j])
+            j++;
+        if (j == commands[i].prefixlen)
+            break;
+    }
+    return i; // ARRAY_COUNT(commands) if not found
+}
+
 static void run_script(Slice code, bool init)
 {
     // init scan
@@ -1122,19 +1166,11 @@ static void run_script(Slice code, bool init)
             noffs = -1;
         //printf("%c%*s%s\n", flow_counter ? '-' : ' ', 2*(nest_counter+noffs), "", to_string(orig_line).c_str());
 
-        int i;
-        for (i=0; i < ARRAY_COUNT(commands); i++) {
-            int j=0;
-            while (j < commands[i].prefixlen && tolower(command[j]) == commands[i].name[j])
-                j++;
-            if (j == commands[i].prefixlen) {
-                if (flow_counter == 0 || commands[i].isflow)
-                    commands[i].exec();
-                break;
-            }
-        }
-
-        if (i == ARRAY_COUNT(commands)) {
+        int i = find_command(command);
+        if (i < ARRAY_COUNT(commands)) {
+            if (flow_counter == 0 || commands[i].isflow)
+                commands[i].exec();
+        } else {
             print(command);
             printf("? (line=\"%s\")\n", to_string(line).c_str());
         }
@@ -1145,22 +1181,244 @@ static void run_script(Slice code, bool init)
     }
 }
 
+// ---- static analysis
+
+static void add_ref(std::vector<Str> *list, const Str &name)
+{
+    if (!name.empty() && std::find(list->begin(), list->end(), name) == list->end())
+        list->push_back(name);
+}
+
+static void add_command_refs(const Str &cmd, std::vector<Str> *files, std::vector<Str> *rooms)
+{
+    Str parse = cmd;
+    Str verb = tolower(chop_until(parse, ' '));
+
+    if (verb == "welt")
+        add_ref(rooms, tolower(parse));
+    else if (verb == "dialog") {
+        Str charname = chop_until(parse, ' ');
+        Str dlgname = chop_until(parse, ' ');
+        if (!charname.empty() && charname[0] == '!')
+            charname = charname.substr(1);
+        if (!dlgname.empty() && dlgname[0] == '2')
+            dlgname = dlgname.substr(1);
+
+        add_ref(files, normalize_path(Str::fmt("chars/%s/face.frz", charname.c_str())));
+        add_ref(files, normalize_path(Str::fmt("chars/%s/sprech.ani", charname.c_str())));
+        add_ref(files, normalize_path(Str::fmt("chars/%s/%s.cm", charname.c_str(), dlgname.c_str())));
+        add_ref(files, normalize_path(Str::fmt("chars/%s/%s.vb", charname.c_str(), dlgname.c_str())));
+    }
+}
+
+void script_scan_refs(const Slice &code, std::vector<Str> *files, std::vector<Str> *rooms,
+    std::vector<Str> *backgrounds, std::vector<Str> *hotmaps)
+{
+    // visits every line regardless of control flow, so the result is a
+    // superset of what any single run of the script touches. only literal
+    // arguments are picked up; names built from variables are skipped.
+    // leaves the scanner alone, so it can run on any thread.
+    Slice rest = code;
+    while (rest.len()) {
+        Slice l = chop_line(rest);
+        skip_whitespace(l);
+
+        Slice command = scan_word(l);
+        int i = command.len() ? find_command(command) : ARRAY_COUNT(commands);
+        if (i == ARRAY_COUNT(commands))
+            continue;
+
+        void (*exec)() = commands[i].exec;
+        if (exec == cmd_pic || exec == cmd_back) {
+            Str filename = normalize_path(to_string(scan_word(l)));
+            add_ref(files, filename);
+            if (backgrounds)
+                add_ref(backgrounds, filename);
+            if (has_suffixi(filename, ".mix"))
+                add_ref(files, replace_ext(filename, ".vb"));
+        } else if (exec == cmd_ani || exec == cmd_big) {
+            Str filename = to_string(scan_word(l)) + ".ani";
+            if (filename[0] == '!')
+                filename = filename.substr(1);
+            add_ref(files, normalize_path(filename));
+        } else if (exec == cmd_megaanim)
+            add_ref(files, normalize_path(to_string(scan_word(l))));
+        else if (exec == cmd_hot) {
+            Str filename = normalize_path(to_string(scan_word(l)));
+            add_ref(files, filename);
+            if (hotmaps)
+                add_ref(hotmaps, filename);
+        } else if (exec == cmd_next) {
+            Str dest = to_string(scan_word(l));
+            if (!dest.empty() && dest.back() != '$')
+                add_ref(rooms, tolower(dest));
+        } else if (exec == cmd_load || exec == cmd_exec)
+            add_command_refs(to_string(l), files, rooms);
+    }
+}
+
+// ---- room preparation
+
+// Room transitions: the next room's script is read and scanned and its
+// backgrounds and hotspot maps are decoded on a worker, typically while the
+// fade-out plays. The main thread picks up the result when the "welt" command
+// runs, or abandons it if the script went somewhere else.
+namespace {
+    struct RoomPrep {
+        Str room;           // lower case; empty until known. guarded by s_prep_mutex
+        bool started;       // guarded by s_prep_mutex
+        bool done;          // guarded by s_prep_mutex
+        std::atomic<bool> cancelled;
+        Slice script;       // owned by the worker until done
+        ImageMap images;    // owned by the worker until done
+
+        RoomPrep()
+            : started(false), done(false)
+        {
+            cancelled = false;
+        }
+    };
+}
+
+static std::shared_ptr<RoomPrep> s_prep;
+static JobGroup s_prep_jobs;
+static std::mutex s_prep_mutex;
+static std::condition_variable s_prep_done;
+
+// runs on the worker; nothing in here may panic
+static void prep_room_files(RoomPrep *prep, const Str &room)
+{
+    Slice script = try_read_xored("data/" + room + ".par");
+    if (!script)
+        return;
+
+    std::vector<Str> files, rooms, backgrounds, hotmaps;
+    script_scan_refs(script, &files, &rooms, &backgrounds, &hotmaps);
+    prep->script = script;
+
+    for (size_t i=0; i < backgrounds.size() && !prep->cancelled; i++)
+        predecode_background(backgrounds[i], &prep->images);
+    for (size_t i=0; i < hotmaps.size() && !prep->cancelled; i++)
+        predecode_hotmap(hotmaps[i], &prep->images);
+}
+
+// Abandons whatever was being prepared. With an empty room, the room is
+// guessed from the script in from.
+static void start_room_prep(const Str &room, const Slice &from)
+{
+    if (s_prep)
+        s_prep->cancelled = true; // its job stops at the next file
+
+    std::shared_ptr<RoomPrep> prep = std::make_shared<RoomPrep>();
+    prep->room = room;
+    s_prep = prep;
+    s_prep_jobs.run([prep, from] {
+        Str room;
+        {
+            std::lock_guard<std::mutex> lock(s_prep_mutex);
+            prep->started = true;
+            if (!prep->cancelled) // else taken before we got to it; nobody waits for us
+                room = prep->room;
+        }
+
+        if (room.empty() && !prep->cancelled) {
+            // best guess: the first room the rest of the script can lead to
+            std::vector<Str> files, rooms;
+            script_scan_refs(from, &files, &rooms);
+            if (!rooms.empty()) {
+                room = rooms[0];
+                std::lock_guard<std::mutex> lock(s_prep_mutex);
+                prep->room = room;
+            }
+        }
+
+        if (!room.empty() && !prep->cancelled)
+            prep_room_files(prep.get(), room);
+
+        std::lock_guard<std::mutex> lock(s_prep_mutex);
+        prep->done = true;
+        s_prep_done.notify_all();
+    });
+}
+
+static void prepare_room(const Str &name)
+{
+    Str room = tolower(name);
+    if (s_prep) {
+        std::lock_guard<std::mutex> lock(s_prep_mutex);
+        if (s_prep->room == room)
+            return;
+    }
+
+    start_room_prep(room, Slice());
+}
+
+static void prepare_next_room()
+{
+    // a room that's already on its way is either the known target or an
+    // earlier guess; either is as good as a new guess
+    if (!s_prep)
+        start_room_prep(Str(), scan);
+}
+
+// Empty if name wasn't prepared; only waits for a prep of the right room
+// that a worker is already busy with.
+static Slice take_prepared_room(const Str &name)
+{
+    std::shared_ptr<RoomPrep> prep = s_prep;
+    s_prep.reset();
+    if (!prep)
+        return Slice();
+
+    std::unique_lock<std::mutex> lock(s_prep_mutex);
+    if (prep->room != tolower(name) || !prep->started) {
+        // a wrong guess, one that isn't made yet, or still queued: reading
+        // the script ourselves is quicker than waiting for a worker
+        prep->cancelled = true;
+        return Slice();
+    }
+
+    while (!prep->done)
+        s_prep_done.wait(lock);
+    lock.unlock();
+
+    if (prep->script)
+        set_predecoded_images(prep->images);
+    return prep->script;
+}
+
 // ---- outer logic
 
 void game_defer_command(const Str &cmd)
 {
     assert(s_command.empty());
     s_command = cmd;
+
+    if (has_prefixi(cmd, "welt "))
+        prepare_room(cmd.substr(5));
 }
 
 void game_run_command(const Str &cmd)
 {
     if (has_prefixi(cmd, "welt ")) {
-        Str filename = "data/" + cmd.substr(5) + ".par";
+        Str room = cmd.substr(5);
+        Str filename = "data/" + room + ".par";
 
         s_mode = GM_ROOM;
-        s_script = read_xored(filename.c_str());
+        s_script = take_prepared_room(room);
+        if (!s_script)
+            s_script = read_xored(filename.c_str());
+
+        // the room setup then finds everything it loads in the asset cache
+        std::vector<Str> files, rooms;
+        script_scan_refs(s_script, &files, &rooms);
+        read_files_batch(files);
+
         run_script(s_script, true);
+        set_predecoded_images(ImageMap()); // only meant for the room setup
+
+        // where we might go next can wait until we're done here
+        manifest_prefetch_neighbours(room);
     } else if (has_prefixi(cmd, "gang ")) {
         // command parsing?
         s_mode = GM_CORRIDOR;
@@ -1188,6 +1446,7 @@ void game_frame()
     // time handling etc. should also go here
 
     frame();
+    scratch_end_frame();
 }
 
 void game_reset()
@@ -1305,8 +1564,18 @@ void game_reload_room()
     s_reload = true;
 }
 
+void game_set_text_shade(int amount)
+{
+    s_text_shade = std::max(0, std::min(amount, 256));
+}
+
 void game_shutdown()
 {
+    if (s_prep)
+        s_prep->cancelled = true;
+    s_prep.reset();
+    s_prep_jobs.wait();
+    set_predecoded_images(ImageMap());
     game_reset();
 }
 
@@ -1,6 +1,8 @@
 #ifndef __SCRIPT_H__
 #define __SCRIPT_H__
 
+#include <vector>
+
 class Slice;
 class PixelSlice;
 class Str;
@@ -13,6 +15,7 @@ void game_frame();
 void game_script_tick();
 void game_script_run(const Slice &script);
 void game_reload_room();
+void game_set_text_shade(int amount); // darkens behind printed text, out of 256; 0 is off
 void game_shutdown();
 
 const unsigned char *game_get_screen_row(int y);
@@ -21,4 +24,9 @@ void game_hotspot_define(int which, char code);
 void game_hotspot_define_multi(int which, char *codes);
 void game_hotspot_disable(int which); // TODO do this differently
 
+// Files and rooms ("welt" targets) a room script refers to via literal arguments.
+// backgrounds and hotmaps optionally get the pic/back and hot files separately.
+void script_scan_refs(const Slice &code, std::vector<Str> *files, std::vector<Str> *rooms,
+    std::vector<Str> *backgrounds=0, std::vector<Str> *hotmaps=0);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,882 @@
+#include "simd.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// ---- cpu features
+
+enum CpuLevel {
+    CPU_PLAIN,
+    CPU_SSE2,
+    CPU_SSSE3,
+    CPU_AVX2,
+};
+
+static CpuLevel detect_cpu_level()
+{
+#if !defined(SIMD_SSE2)
+    return CPU_PLAIN;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxleaf = info[0];
+
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    if (!ssse3)
+        return CPU_SSE2;
+
+    // AVX state has to be enabled by the OS too
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (maxleaf < 7 || !osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return CPU_SSSE3;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) ? CPU_AVX2 : CPU_SSSE3;
+#else
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+    return __builtin_cpu_supports("ssse3") ? CPU_SSSE3 : CPU_SSE2;
+#endif
+}
+
+static const CpuLevel s_cpu_level = detect_cpu_level();
+static const bool s_has_avx2 = s_cpu_level >= CPU_AVX2;
+
+bool cpu_has_avx2()
+{
+    return s_has_avx2;
+}
+
+// ---- byte search
+
+static int lowest_set_bit(U32 mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static const U8 *find_byte_c(const U8 *p, const U8 *end, U8 value)
+{
+    while (p < end && *p != value)
+        p++;
+    return p;
+}
+
+#ifdef SIMD_SSE2
+static const U8 *find_byte_sse2(const U8 *p, const U8 *end, U8 value)
+{
+    __m128i v = _mm_set1_epi8((char) value);
+    for (; end - p >= 16; p += 16) {
+        U32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), v));
+        if (mask)
+            return p + lowest_set_bit(mask);
+    }
+    return find_byte_c(p, end, value);
+}
+
+TARGET_AVX2 static const U8 *find_byte_avx2(const U8 *p, const U8 *end, U8 value)
+{
+    __m256i v = _mm256_set1_epi8((char) value);
+    for (; end - p >= 32; p += 32) {
+        U32 mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), v));
+        if (mask)
+            return p + lowest_set_bit(mask);
+    }
+    return find_byte_c(p, end, value);
+}
+#endif
+
+const U8 *find_byte(const U8 *p, const U8 *end, U8 value)
+{
+#ifdef SIMD_SSE2
+    // short spans aren't worth the setup
+    if (end - p < 16)
+        return find_byte_c(p, end, value);
+    return s_has_avx2 ? find_byte_avx2(p, end, value) : find_byte_sse2(p, end, value);
+#else
+    return find_byte_c(p, end, value);
+#endif
+}
+
+static const int MAX_SET = 8;
+
+static bool in_set(U8 c, const char *set)
+{
+    for (; *set; set++)
+        if (c == (U8) *set)
+            return true;
+    return false;
+}
+
+static const U8 *find_any_byte_c(const U8 *p, const U8 *end, const char *set)
+{
+    while (p < end && !in_set(*p, set))
+        p++;
+    return p;
+}
+
+#ifdef SIMD_SSE2
+static const U8 *find_any_byte_sse2(const U8 *p, const U8 *end, const char *set, int nset)
+{
+    __m128i v[MAX_SET];
+    for (int i=0; i < nset; i++)
+        v[i] = _mm_set1_epi8(set[i]);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) p);
+        __m128i hit = _mm_cmpeq_epi8(x, v[0]);
+        for (int i=1; i < nset; i++)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, v[i]));
+
+        U32 mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return p + lowest_set_bit(mask);
+    }
+    return find_any_byte_c(p, end, set);
+}
+
+TARGET_AVX2 static const U8 *find_any_byte_avx2(const U8 *p, const U8 *end, const char *set, int nset)
+{
+    __m256i v[MAX_SET];
+    for (int i=0; i < nset; i++)
+        v[i] = _mm256_set1_epi8(set[i]);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) p);
+        __m256i hit = _mm256_cmpeq_epi8(x, v[0]);
+        for (int i=1; i < nset; i++)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(x, v[i]));
+
+        U32 mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return p + lowest_set_bit(mask);
+    }
+    return find_any_byte_c(p, end, set);
+}
+#endif
+
+const U8 *find_any_byte(const U8 *p, const U8 *end, const char *set)
+{
+    int nset = (int) strlen(set);
+    assert(nset >= 1 && nset <= MAX_SET);
+#ifdef SIMD_SSE2
+    if (end - p < 16)
+        return find_any_byte_c(p, end, set);
+    return s_has_avx2 ? find_any_byte_avx2(p, end, set, nset) : find_any_byte_sse2(p, end, set, nset);
+#else
+    return find_any_byte_c(p, end, set);
+#endif
+}
+
+// ---- case folding
+
+static U8 fold_c(U8 c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+#ifdef SIMD_SSE2
+static __m128i fold_sse2(__m128i x)
+{
+    // signed compares, so bytes >= 0x80 are left alone
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+#endif
+
+bool equal_nocase(const U8 *a, const U8 *b, U32 n)
+{
+    U32 i = 0;
+#ifdef SIMD_SSE2
+    // names and keywords are short, 16 bytes at a time is plenty
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = fold_sse2(_mm_loadu_si128((const __m128i *) (a + i)));
+        __m128i y = fold_sse2(_mm_loadu_si128((const __m128i *) (b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+            return false;
+    }
+#endif
+    for (; i < n; i++)
+        if (fold_c(a[i]) != fold_c(b[i]))
+            return false;
+    return true;
+}
+
+// ---- xor
+
+static void xor_bytes_c(U8 *p, U32 n, U8 key)
+{
+    for (U32 i=0; i < n; i++)
+        p[i] ^= key;
+}
+
+#ifdef SIMD_SSE2
+static void xor_bytes_sse2(U8 *p, U32 n, U8 key)
+{
+    __m128i k = _mm_set1_epi8((char) key);
+    U32 i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i *q = (__m128i *) (p + i);
+        _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), k));
+    }
+    xor_bytes_c(p + i, n - i, key);
+}
+
+TARGET_AVX2 static void xor_bytes_avx2(U8 *p, U32 n, U8 key)
+{
+    __m256i k = _mm256_set1_epi8((char) key);
+    U32 i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i *q = (__m256i *) (p + i);
+        _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q), k));
+    }
+    xor_bytes_sse2(p + i, n - i, key);
+}
+#endif
+
+void xor_bytes(U8 *p, U32 n, U8 key)
+{
+#ifdef SIMD_SSE2
+    if (s_has_avx2)
+        xor_bytes_avx2(p, n, key);
+    else
+        xor_bytes_sse2(p, n, key);
+#else
+    xor_bytes_c(p, n, key);
+#endif
+}
+
+// ---- pixel rows
+
+struct RowKernels {
+    void (*blit[6])(U8 *dst, const U8 *src, int n); // by step_index
+    void (*mask[2])(U8 *dst, const U8 *src0, const U8 *src1, int n, U8 color); // steps 2, -2
+    void (*replace)(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols);
+    void (*reverse)(U8 *row, int n);
+    void (*blend)(U8 *dst, const U8 *src, int n, const U8 *table);
+    void (*lookup)(U8 *dst, const U8 *mask, int n, const U8 *map);
+};
+
+static int step_index(int step)
+{
+    switch (step) {
+    case 1:     return 0;
+    case 2:     return 1;
+    case 4:     return 2;
+    case -1:    return 3;
+    case -2:    return 4;
+    case -4:    return 5;
+    default:    return -1;
+    }
+}
+
+static void blit_row_c(U8 *dst, const U8 *src, int n, int step)
+{
+    for (int x=0; x < n; x++) {
+        U8 c = src[x*step];
+        if (c)
+            dst[x] = c;
+    }
+}
+
+template<int step>
+static void blit_row_plain(U8 *dst, const U8 *src, int n)
+{
+    blit_row_c(dst, src, n, step);
+}
+
+static void mask_row_c(U8 *dst, const U8 *src0, const U8 *src1, int n, int step, U8 color)
+{
+    for (int x=0; x < n; x++) {
+        int xs = x*step;
+        if (src0[xs] | src0[xs + 1] | src1[xs] | src1[xs + 1])
+            dst[x] = color;
+    }
+}
+
+template<int step>
+static void mask_row_plain(U8 *dst, const U8 *src0, const U8 *src1, int n, U8 color)
+{
+    mask_row_c(dst, src0, src1, n, step, color);
+}
+
+static void replace_row_c(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols)
+{
+    for (int x=0; x < n; x++) {
+        U8 c = src[x], r = c;
+        for (int i=0; i < ncols; i++) // later entries win, like a map built in order
+            if (c == from_col[i])
+                r = to_col[i];
+        dst[x] = r;
+    }
+}
+
+static void reverse_row_c(U8 *row, int n)
+{
+    for (int x=0; x < n/2; x++) {
+        U8 a = row[x];
+        row[x] = row[n-1-x];
+        row[n-1-x] = a;
+    }
+}
+
+static void blend_row_c(U8 *dst, const U8 *src, int n, const U8 *table)
+{
+    for (int x=0; x < n; x++) {
+        U8 s = src[x], d = dst[x];
+        dst[x] = s ? table[s*256 + d] : d;
+    }
+}
+
+static void lookup_row_c(U8 *dst, const U8 *mask, int n, const U8 *map)
+{
+    if (!mask) {
+        for (int x=0; x < n; x++)
+            dst[x] = map[dst[x]];
+    } else {
+        for (int x=0; x < n; x++)
+            if (mask[x])
+                dst[x] = map[dst[x]];
+    }
+}
+
+#ifdef SIMD_SSE2
+
+// Wider steps read the bytes between samples too, so a vector may only
+// be used while the sample after it still exists.
+#define SAMPLES_FIT(x, width, n, step) ((x) + (width) + ((step) != 1 && (step) != -1) <= (n))
+
+static __m128i load16(const U8 *p)
+{
+    return _mm_loadu_si128((const __m128i *) p);
+}
+
+// s where it's nonzero, d elsewhere
+static __m128i blend_opaque(__m128i d, __m128i s)
+{
+    __m128i clear = _mm_cmpeq_epi8(s, _mm_setzero_si128());
+    return _mm_or_si128(_mm_and_si128(clear, d), _mm_andnot_si128(clear, s));
+}
+
+// 0xff for each 2x2 block (pair of bytes in two rows) that's all zero
+static __m128i empty_blocks(const U8 *p0, const U8 *p1)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_cmpeq_epi16(_mm_or_si128(load16(p0), load16(p1)), zero);
+    __m128i hi = _mm_cmpeq_epi16(_mm_or_si128(load16(p0 + 16), load16(p1 + 16)), zero);
+    return _mm_packs_epi16(lo, hi);
+}
+
+static __m128i reverse_sse2(__m128i v)
+{
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// p[0], p[step], ... p[15*step]
+template<int step>
+static __m128i samples_sse2(const U8 *p)
+{
+    if (step == 1)
+        return load16(p);
+    if (step == -1)
+        return reverse_sse2(load16(p - 15));
+
+    if (step == 2 || step == -2) {
+        // even bytes going up, odd bytes of the window below p going down
+        __m128i lo = load16(step > 0 ? p : p - 31);
+        __m128i hi = load16(step > 0 ? p + 16 : p - 15);
+        if (step > 0) {
+            __m128i even = _mm_set1_epi16(0xff);
+            return _mm_packus_epi16(_mm_and_si128(lo, even), _mm_and_si128(hi, even));
+        }
+        return reverse_sse2(_mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+
+    // step 4 / -4
+    const U8 *base = step > 0 ? p : p - 63;
+    __m128i v[4];
+    for (int i=0; i < 4; i++) {
+        v[i] = load16(base + 16*i);
+        v[i] = step > 0 ? _mm_and_si128(v[i], _mm_set1_epi32(0xff)) : _mm_srli_epi32(v[i], 24);
+    }
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+    return step > 0 ? r : reverse_sse2(r);
+}
+
+template<int step>
+static void blit_row_sse2(U8 *dst, const U8 *src, int n)
+{
+    int x = 0;
+    for (; SAMPLES_FIT(x, 16, n, step); x += 16) {
+        __m128i *d = (__m128i *) (dst + x);
+        _mm_storeu_si128(d, blend_opaque(_mm_loadu_si128(d), samples_sse2<step>(src + x*step)));
+    }
+    blit_row_c(dst + x, src + x*step, n - x, step);
+}
+
+template<int step>
+static void mask_row_sse2(U8 *dst, const U8 *src0, const U8 *src1, int n, U8 color)
+{
+    // flipped rows: block x sits at -2x, so take the window below and reverse
+    const int offs = step > 0 ? 0 : -30;
+    __m128i c = _mm_set1_epi8((char) color);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i empty = empty_blocks(src0 + x*step + offs, src1 + x*step + offs);
+        if (step < 0)
+            empty = reverse_sse2(empty);
+        __m128i *d = (__m128i *) (dst + x);
+        _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(empty, _mm_loadu_si128(d)), _mm_andnot_si128(empty, c)));
+    }
+    mask_row_c(dst + x, src0 + x*step, src1 + x*step, n - x, step, color);
+}
+
+static void replace_row_sse2(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i s = load16(src + x);
+        __m128i r = s;
+        for (int i=0; i < ncols; i++) {
+            __m128i hit = _mm_cmpeq_epi8(s, _mm_set1_epi8((char) from_col[i]));
+            r = _mm_or_si128(_mm_andnot_si128(hit, r), _mm_and_si128(hit, _mm_set1_epi8((char) to_col[i])));
+        }
+        _mm_storeu_si128((__m128i *) (dst + x), r);
+    }
+    replace_row_c(dst + x, src + x, n - x, from_col, to_col, ncols);
+}
+
+static void reverse_row_sse2(U8 *row, int n)
+{
+    // swap 16 byte blocks from both ends, the middle is left to the C loop
+    int lo = 0, hi = n;
+    for (; hi - lo >= 32; lo += 16, hi -= 16) {
+        __m128i a = load16(row + lo);
+        __m128i b = load16(row + hi - 16);
+        _mm_storeu_si128((__m128i *) (row + lo), reverse_sse2(b));
+        _mm_storeu_si128((__m128i *) (row + hi - 16), reverse_sse2(a));
+    }
+    reverse_row_c(row + lo, hi - lo);
+}
+
+// SSSE3: byte shuffles do the reversing and the decimation in one go
+
+TARGET_SSSE3 static __m128i reverse_ssse3(__m128i v)
+{
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+template<int step>
+TARGET_SSSE3 static __m128i samples_ssse3(const U8 *p)
+{
+    if (step == 1)
+        return load16(p);
+    if (step == -1)
+        return reverse_ssse3(load16(p - 15));
+
+    if (step == 2) {
+        __m128i pick = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+        return _mm_unpacklo_epi64(_mm_shuffle_epi8(load16(p), pick), _mm_shuffle_epi8(load16(p + 16), pick));
+    }
+    if (step == -2) {
+        __m128i pick = _mm_setr_epi8(15, 13, 11, 9, 7, 5, 3, 1, -1, -1, -1, -1, -1, -1, -1, -1);
+        return _mm_unpacklo_epi64(_mm_shuffle_epi8(load16(p - 15), pick), _mm_shuffle_epi8(load16(p - 31), pick));
+    }
+
+    // step 4 / -4: four samples out of each 16 bytes
+    __m128i pick = step > 0 ? _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+                            : _mm_setr_epi8(15, 11, 7, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const int offs = step > 0 ? 0 : -15;
+    const int dir = step > 0 ? 16 : -16;
+    __m128i a = _mm_shuffle_epi8(load16(p + offs), pick);
+    __m128i b = _mm_shuffle_epi8(load16(p + offs + dir), pick);
+    __m128i c = _mm_shuffle_epi8(load16(p + offs + 2*dir), pick);
+    __m128i d = _mm_shuffle_epi8(load16(p + offs + 3*dir), pick);
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d));
+}
+
+template<int step>
+TARGET_SSSE3 static void blit_row_ssse3(U8 *dst, const U8 *src, int n)
+{
+    int x = 0;
+    for (; SAMPLES_FIT(x, 16, n, step); x += 16) {
+        __m128i *d = (__m128i *) (dst + x);
+        _mm_storeu_si128(d, blend_opaque(_mm_loadu_si128(d), samples_ssse3<step>(src + x*step)));
+    }
+    blit_row_c(dst + x, src + x*step, n - x, step);
+}
+
+TARGET_SSSE3 static void mask_row_flip_ssse3(U8 *dst, const U8 *src0, const U8 *src1, int n, U8 color)
+{
+    __m128i c = _mm_set1_epi8((char) color);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i empty = reverse_ssse3(empty_blocks(src0 - 2*x - 30, src1 - 2*x - 30));
+        __m128i *d = (__m128i *) (dst + x);
+        _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(empty, _mm_loadu_si128(d)), _mm_andnot_si128(empty, c)));
+    }
+    mask_row_c(dst + x, src0 - 2*x, src1 - 2*x, n - x, -2, color);
+}
+
+TARGET_SSSE3 static void reverse_row_ssse3(U8 *row, int n)
+{
+    int lo = 0, hi = n;
+    for (; hi - lo >= 32; lo += 16, hi -= 16) {
+        __m128i a = load16(row + lo);
+        __m128i b = load16(row + hi - 16);
+        _mm_storeu_si128((__m128i *) (row + lo), reverse_ssse3(b));
+        _mm_storeu_si128((__m128i *) (row + hi - 16), reverse_ssse3(a));
+    }
+    reverse_row_c(row + lo, hi - lo);
+}
+
+// AVX2: 32 pixels at a time where no shuffles cross the two lanes
+
+TARGET_AVX2 static __m256i load32(const U8 *p)
+{
+    return _mm256_loadu_si256((const __m256i *) p);
+}
+
+TARGET_AVX2 static __m256i reverse_avx2(__m256i v)
+{
+    __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                   15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, rev), _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+template<int step> // 1 or -1
+TARGET_AVX2 static void blit_row_avx2(U8 *dst, const U8 *src, int n)
+{
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i s = step > 0 ? load32(src + x) : reverse_avx2(load32(src - x - 31));
+        __m256i *d = (__m256i *) (dst + x);
+        __m256i clear = _mm256_cmpeq_epi8(s, _mm256_setzero_si256());
+        _mm256_storeu_si256(d, _mm256_blendv_epi8(s, _mm256_loadu_si256(d), clear));
+    }
+    blit_row_ssse3<step>(dst + x, src + x*step, n - x);
+}
+
+TARGET_AVX2 static void replace_row_avx2(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols)
+{
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i s = load32(src + x);
+        __m256i r = s;
+        for (int i=0; i < ncols; i++) {
+            __m256i hit = _mm256_cmpeq_epi8(s, _mm256_set1_epi8((char) from_col[i]));
+            r = _mm256_blendv_epi8(r, _mm256_set1_epi8((char) to_col[i]), hit);
+        }
+        _mm256_storeu_si256((__m256i *) (dst + x), r);
+    }
+    replace_row_sse2(dst + x, src + x, n - x, from_col, to_col, ncols);
+}
+
+TARGET_AVX2 static void reverse_row_avx2(U8 *row, int n)
+{
+    int lo = 0, hi = n;
+    for (; hi - lo >= 64; lo += 32, hi -= 32) {
+        __m256i a = load32(row + lo);
+        __m256i b = load32(row + hi - 32);
+        _mm256_storeu_si256((__m256i *) (row + lo), reverse_avx2(b));
+        _mm256_storeu_si256((__m256i *) (row + hi - 32), reverse_avx2(a));
+    }
+    reverse_row_ssse3(row + lo, hi - lo);
+}
+
+// Table lookups gather 8 pixels at a time. Each lane reads 4 bytes, which
+// is why the tables need slack at the end. keep lanes stay d.
+TARGET_AVX2 static void store_lookups8(U8 *dst, const U8 *table, __m256i idx, __m256i d, __m256i keep)
+{
+    __m256i r = _mm256_i32gather_epi32((const int *) table, idx, 1);
+    r = _mm256_blendv_epi8(_mm256_and_si256(r, _mm256_set1_epi32(0xff)), d, keep);
+    __m128i p = _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    _mm_storel_epi64((__m128i *) dst, _mm_packus_epi16(p, p));
+}
+
+TARGET_AVX2 static __m256i load8_u32(const U8 *p)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) p));
+}
+
+TARGET_AVX2 static void blend_row_avx2(U8 *dst, const U8 *src, int n, const U8 *table)
+{
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i s = load8_u32(src + x);
+        __m256i d = load8_u32(dst + x);
+        __m256i keep = _mm256_cmpeq_epi32(s, _mm256_setzero_si256());
+        store_lookups8(dst + x, table, _mm256_or_si256(_mm256_slli_epi32(s, 8), d), d, keep);
+    }
+    blend_row_c(dst + x, src + x, n - x, table);
+}
+
+TARGET_AVX2 static void lookup_row_avx2(U8 *dst, const U8 *mask, int n, const U8 *map)
+{
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i d = load8_u32(dst + x);
+        __m256i keep = mask ? _mm256_cmpeq_epi32(load8_u32(mask + x), _mm256_setzero_si256()) : _mm256_setzero_si256();
+        store_lookups8(dst + x, map, d, d, keep);
+    }
+    lookup_row_c(dst + x, mask ? mask + x : 0, n - x, map);
+}
+#endif
+
+static RowKernels pick_row_kernels(CpuLevel level)
+{
+    RowKernels k = {
+        { blit_row_plain<1>, blit_row_plain<2>, blit_row_plain<4>, blit_row_plain<-1>, blit_row_plain<-2>, blit_row_plain<-4> },
+        { mask_row_plain<2>, mask_row_plain<-2> },
+        replace_row_c,
+        reverse_row_c,
+        blend_row_c,
+        lookup_row_c,
+    };
+#ifdef SIMD_SSE2
+    if (level >= CPU_SSE2) {
+        RowKernels sse2 = {
+            { blit_row_sse2<1>, blit_row_sse2<2>, blit_row_sse2<4>, blit_row_sse2<-1>, blit_row_sse2<-2>, blit_row_sse2<-4> },
+            { mask_row_sse2<2>, mask_row_sse2<-2> },
+            replace_row_sse2,
+            reverse_row_sse2,
+            blend_row_c,
+            lookup_row_c,
+        };
+        k = sse2;
+    }
+    if (level >= CPU_SSSE3) {
+        RowKernels ssse3 = {
+            { blit_row_ssse3<1>, blit_row_ssse3<2>, blit_row_ssse3<4>, blit_row_ssse3<-1>, blit_row_ssse3<-2>, blit_row_ssse3<-4> },
+            { mask_row_sse2<2>, mask_row_flip_ssse3 },
+            replace_row_sse2,
+            reverse_row_ssse3,
+            blend_row_c,
+            lookup_row_c,
+        };
+        k = ssse3;
+    }
+    if (level >= CPU_AVX2) {
+        k.blit[0] = blit_row_avx2<1>;
+        k.blit[3] = blit_row_avx2<-1>;
+        k.replace = replace_row_avx2;
+        k.reverse = reverse_row_avx2;
+        k.blend = blend_row_avx2;
+        k.lookup = lookup_row_avx2;
+    }
+#endif
+
+    return k;
+}
+
+static const RowKernels s_rows = pick_row_kernels(s_cpu_level);
+
+void blit_row_transparent(U8 *dst, const U8 *src, int n, int step)
+{
+    int i = step_index(step);
+    if (i < 0)
+        blit_row_c(dst, src, n, step);
+    else
+        s_rows.blit[i](dst, src, n);
+}
+
+void blit_row_mask(U8 *dst, const U8 *src0, const U8 *src1, int n, int step, U8 color)
+{
+    if (step == 2 || step == -2)
+        s_rows.mask[step < 0](dst, src0, src1, n, color);
+    else
+        mask_row_c(dst, src0, src1, n, step, color);
+}
+
+void replace_colors_row(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols)
+{
+    s_rows.replace(dst, src, n, from_col, to_col, ncols);
+}
+
+void reverse_row(U8 *row, int n)
+{
+    s_rows.reverse(row, n);
+}
+
+void blend_row(U8 *dst, const U8 *src, int n, const U8 *table)
+{
+    s_rows.blend(dst, src, n, table);
+}
+
+void lookup_row(U8 *dst, const U8 *mask, int n, const U8 *map)
+{
+    s_rows.lookup(dst, mask, n, map);
+}
+
+// ---- palette search
+
+#ifndef SIMD_SSE2
+static int closest_color_c(const S16 *planes, int r, int g, int b)
+{
+    int best = 0, bestd = 1 << 30;
+    for (int i=0; i < 256; i++) {
+        if (planes[i] < 0)
+            continue;
+        int dr = planes[i] - r, dg = planes[256 + i] - g, db = planes[512 + i] - b;
+        int d = dr*dr + dg*dg + db*db;
+        if (d < bestd) {
+            bestd = d;
+            best = i;
+        }
+    }
+    return best;
+}
+#else
+// 8 entries at a time; distances of 6-bit components fit in 16 bits
+static int closest_color_sse2(const S16 *planes, int r, int g, int b)
+{
+    __m128i vr = _mm_set1_epi16((short) r), vg = _mm_set1_epi16((short) g), vb = _mm_set1_epi16((short) b);
+    __m128i bestd = _mm_set1_epi16(0x7fff), besti = _mm_setzero_si128();
+    __m128i idx = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i=0; i < 256; i += 8) {
+        __m128i pr = _mm_loadu_si128((const __m128i *) (planes + i));
+        __m128i dr = _mm_sub_epi16(pr, vr);
+        __m128i dg = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (planes + 256 + i)), vg);
+        __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (planes + 512 + i)), vb);
+        __m128i d = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(dr, dr), _mm_mullo_epi16(dg, dg)), _mm_mullo_epi16(db, db));
+        __m128i unused = _mm_cmplt_epi16(pr, _mm_setzero_si128());
+        d = _mm_or_si128(d, _mm_and_si128(unused, _mm_set1_epi16(0x7fff))); // never closer than bestd starts
+
+        __m128i closer = _mm_cmplt_epi16(d, bestd); // strict, so each lane keeps its first hit
+        bestd = _mm_min_epi16(d, bestd);
+        besti = _mm_or_si128(_mm_and_si128(closer, idx), _mm_andnot_si128(closer, besti));
+        idx = _mm_add_epi16(idx, _mm_set1_epi16(8));
+    }
+
+    S16 d[8], i[8];
+    _mm_storeu_si128((__m128i *) d, bestd);
+    _mm_storeu_si128((__m128i *) i, besti);
+    int best = 0;
+    for (int k=1; k < 8; k++)
+        if (d[k] < d[best] || (d[k] == d[best] && i[k] < i[best]))
+            best = k;
+    return i[best];
+}
+#endif
+
+int closest_color(const S16 *planes, int r, int g, int b)
+{
+#ifdef SIMD_SSE2
+    return closest_color_sse2(planes, r, g, b);
+#else
+    return closest_color_c(planes, r, g, b);
+#endif
+}
+
+// ---- inverse palette
+
+// Works in doubled units so the cell centers (2k + 0.5 in 6-bit terms) are
+// whole numbers: a color at 2p, a cell center at 4k + 1. The largest squared
+// distance is 3*125*125, which fits in 16 bits.
+#ifndef SIMD_SSE2
+static U16 inverse_row_c(U16 *dist, U8 *map, const U16 *db2, int drg, U8 index)
+{
+    U16 worst = 0;
+    for (int b=0; b < 32; b++) {
+        U16 d = (U16) (drg + db2[b]);
+        if (d < dist[b]) {
+            dist[b] = d;
+            map[b] = index;
+        }
+        worst = std::max(worst, dist[b]);
+    }
+    return worst;
+}
+#else
+// SSE2 has no unsigned 16-bit compares or min/max, but a saturating
+// subtract gives the amount a cell gets closer by, 0 if it doesn't
+static U16 inverse_row_sse2(U16 *dist, U8 *map, const U16 *db2, int drg, U8 index)
+{
+    __m128i vrg = _mm_set1_epi16((short) drg), vi = _mm_set1_epi8((char) index);
+    __m128i zero = _mm_setzero_si128(), worst = zero;
+    for (int b=0; b < 32; b += 16) {
+        __m128i old0 = _mm_loadu_si128((const __m128i *) (dist + b));
+        __m128i old1 = _mm_loadu_si128((const __m128i *) (dist + b + 8));
+        __m128i gain0 = _mm_subs_epu16(old0, _mm_add_epi16(_mm_loadu_si128((const __m128i *) (db2 + b)), vrg));
+        __m128i gain1 = _mm_subs_epu16(old1, _mm_add_epi16(_mm_loadu_si128((const __m128i *) (db2 + b + 8)), vrg));
+        __m128i keep = _mm_packs_epi16(_mm_cmpeq_epi16(gain0, zero), _mm_cmpeq_epi16(gain1, zero));
+
+        __m128i m = _mm_loadu_si128((const __m128i *) (map + b));
+        _mm_storeu_si128((__m128i *) (map + b), _mm_or_si128(_mm_and_si128(keep, m), _mm_andnot_si128(keep, vi)));
+
+        __m128i new0 = _mm_sub_epi16(old0, gain0), new1 = _mm_sub_epi16(old1, gain1);
+        _mm_storeu_si128((__m128i *) (dist + b), new0);
+        _mm_storeu_si128((__m128i *) (dist + b + 8), new1);
+        worst = _mm_add_epi16(worst, _mm_subs_epu16(new0, worst)); // unsigned max
+        worst = _mm_add_epi16(worst, _mm_subs_epu16(new1, worst));
+    }
+
+    U16 w[8];
+    _mm_storeu_si128((__m128i *) w, worst);
+    return *std::max_element(w, w + 8);
+}
+#endif
+
+// Goes color by color, but only over the cells it could still get closer
+// to: each row of 32 b cells remembers the worst distance in it and each r
+// slab the worst of its rows, and a color whose distance to the row (or
+// slab) is already that much skips it. Updates are strict, so the lowest
+// index wins ties, as with closest_color.
+void build_inverse_palette(const S16 *planes, int first, U8 *map)
+{
+    std::vector<U16> dist(32*32*32, 0xffff);
+    U16 rowmax[32*32], slabmax[32];
+    std::fill(rowmax, rowmax + 32*32, 0xffff);
+    std::fill(slabmax, slabmax + 32, 0xffff);
+
+    for (int i=first; i < 256; i++) {
+        if (planes[i] < 0)
+            continue;
+
+        int pr = 2 * planes[i], pg = 2 * planes[256 + i], pb = 2 * planes[512 + i];
+        U16 db2[32];
+        int mindb = 1 << 30;
+        for (int b=0; b < 32; b++) {
+            int d = 4*b + 1 - pb;
+            db2[b] = (U16) (d*d);
+            mindb = std::min(mindb, d*d);
+        }
+
+        for (int r=0; r < 32; r++) {
+            int dr = 4*r + 1 - pr;
+            if (dr*dr + mindb >= slabmax[r])
+                continue;
+
+            U16 worst = 0;
+            for (int g=0; g < 32; g++) {
+                int dg = 4*g + 1 - pg;
+                int drg = dr*dr + dg*dg;
+                U16 &row = rowmax[r*32 + g];
+                if (drg + mindb < row) {
+                    int cell = (r*32 + g) * 32;
+#ifdef SIMD_SSE2
+                    row = inverse_row_sse2(&dist[cell], map + cell, db2, drg, (U8) i);
+#else
+                    row = inverse_row_c(&dist[cell], map + cell, db2, drg, (U8) i);
+#endif
+                }
+                worst = std::max(worst, row);
+            }
+            slabmax[r] = worst;
+        }
+    }
+}
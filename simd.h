@@ -0,0 +1,97 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "common.h"
+#include <string.h>
+
+// SSE2 is the baseline on x86/x64 and used directly; AVX2 paths are
+// picked at run time. Other targets get the plain C versions.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(SIMD_SSE2) && !defined(_MSC_VER)
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSSE3 // MSVC lets any function use any intrinsics
+#define TARGET_AVX2
+#endif
+
+bool cpu_has_avx2();
+
+const U8 *find_byte(const U8 *p, const U8 *end, U8 value); // first match in [p,end), or end
+const U8 *find_any_byte(const U8 *p, const U8 *end, const char *set); // same for any of up to 8 bytes
+bool equal_nocase(const U8 *a, const U8 *b, U32 n); // ASCII case folding only
+void xor_bytes(U8 *p, U32 n, U8 key);
+
+// Pixel row kernels for the blitters in graphics.cpp. Source pixels are
+// read at src[x*step] for x in [0,n), so negative steps walk right to
+// left; steps of 1, 2 and 4 either way have vector paths.
+void blit_row_transparent(U8 *dst, const U8 *src, int n, int step); // 0 pixels are skipped
+void blit_row_mask(U8 *dst, const U8 *src0, const U8 *src1, int n, int step, U8 color); // dst[x] = color if the 2x2 block at src0/src1 + x*step isn't all 0
+void replace_colors_row(U8 *dst, const U8 *src, int n, const U8 *from_col, const U8 *to_col, int ncols);
+void reverse_row(U8 *row, int n);
+
+// Table lookups. AVX2 gathers read 4 bytes per entry, so tables must stay
+// readable 3 bytes past their end: a map is 256 + 3 bytes, not a plain
+// U8[256].
+void blend_row(U8 *dst, const U8 *src, int n, const U8 *table); // dst[x] = table[src[x]*256 + dst[x]] where src[x] != 0
+void lookup_row(U8 *dst, const U8 *mask, int n, const U8 *map); // dst[x] = map[dst[x]], only where mask[x] != 0 unless mask is 0
+
+// Index of the palette entry closest to (r,g,b) by squared distance, the
+// lowest one on ties. planes holds the palette's 6-bit r, then g, then b;
+// entries with a negative r aren't used.
+int closest_color(const S16 *planes, int r, int g, int b);
+
+// closest_color for every color at 5 bits per component, into the 32768
+// byte map[(r >> 1)*32*32 + (g >> 1)*32 + (b >> 1)] of 6-bit r,g,b, as
+// measured from the middle of each cell. Entries below first, or with a
+// negative r, aren't used.
+void build_inverse_palette(const S16 *planes, int first, U8 *map);
+
+// Exact-length copy and fill: long ones go 16 bytes at a time with an
+// overlapping last store, so nothing outside [dst, dst+n) gets written.
+inline void copy_bytes(U8 *dst, const U8 *src, U32 n)
+{
+#ifdef SIMD_SSE2
+    if (n >= 16) {
+        for (U32 i=0; i + 16 < n; i += 16)
+            _mm_storeu_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *) (src + i)));
+        _mm_storeu_si128((__m128i *) (dst + n - 16), _mm_loadu_si128((const __m128i *) (src + n - 16)));
+        return;
+    } else if (n >= 8) {
+        _mm_storel_epi64((__m128i *) dst, _mm_loadl_epi64((const __m128i *) src));
+        _mm_storel_epi64((__m128i *) (dst + n - 8), _mm_loadl_epi64((const __m128i *) (src + n - 8)));
+        return;
+    }
+#endif
+    if (n >= 4) {
+        U32 a, b;
+        memcpy(&a, src, 4);
+        memcpy(&b, src + n - 4, 4);
+        memcpy(dst, &a, 4);
+        memcpy(dst + n - 4, &b, 4);
+    } else {
+        for (U32 i=0; i < n; i++)
+            dst[i] = src[i];
+    }
+}
+
+inline void fill_bytes(U8 *dst, U8 value, U32 n)
+{
+#ifdef SIMD_SSE2
+    if (n >= 16) {
+        __m128i v = _mm_set1_epi8((char) value);
+        for (U32 i=0; i + 16 < n; i += 16)
+            _mm_storeu_si128((__m128i *) (dst + i), v);
+        _mm_storeu_si128((__m128i *) (dst + n - 16), v);
+        return;
+    }
+#endif
+    memset(dst, value, n);
+}
+
+#endif
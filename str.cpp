@@ -1,19 +1,18 @@
 #define _CRT_SECURE_NO_DEPRECATE
 #include "str.h"
 #include "common.h"
+#include "simd.h"
+#include "pool.h"
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
-#include <malloc.h>
 #include <ctype.h>
 
 void Str::alloc(int maxlen)
 {
     alen = 0;
     acap = maxlen + 1;
-    buf = (char *)malloc(acap);
-    if (!buf)
-        panic("out of memory");
+    buf = (char *)pool_alloc(acap);
     buf[0] = 0;
 }
 
@@ -34,7 +33,7 @@ void Str::init(const void *data, int len)
 void Str::fini()
 {
     if (acap)
-        free(buf);
+        pool_free(buf);
 }
 
 void Str::grow()
@@ -51,9 +50,7 @@ void Str::grow_to(int newlen)
         alloc(newlen);
     else {
         acap = newlen + 1;
-        buf = (char *)realloc(buf, acap);
-        if (!buf)
-            panic("out of memory");
+        buf = (char *)pool_realloc(buf, acap);
     }
 }
 
@@ -207,10 +204,8 @@ Str chop_until(Str &from, char sep)
 
 bool has_prefixi(const char *str, const char *prefix)
 {
-    int pos = 0;
-    while (prefix[pos] && tolower(str[pos]) == tolower(prefix[pos]))
-        pos++;
-    return prefix[pos] == 0;
+    size_t len = strlen(prefix);
+    return strnlen(str, len) == len && equal_nocase((const U8 *) str, (const U8 *) prefix, (U32) len);
 }
 
 bool has_suffixi(const char *str, const char *suffix)
@@ -220,10 +215,5 @@ bool has_suffixi(const char *str, const char *suffix)
     if (lensuf > len)
         return false;
 
-    int offs = len - lensuf;
-    for (int i=0; suffix[i]; i++)
-        if (tolower(str[offs+i]) != tolower(suffix[i]))
-            return false;
-
-    return true;
+    return equal_nocase((const U8 *) str + len - lensuf, (const U8 *) suffix, lensuf);
 }
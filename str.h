@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <functional>
 
 class Str {
     char *buf;      // never 0!
@@ -67,4 +68,19 @@ inline bool has_suffixi(const Str &str, const char *prefix) { return has_suffixi
 inline bool has_suffixi(const char *str, const Str &prefix) { return has_suffixi(str, prefix.c_str()); }
 inline bool has_suffixi(const Str &str, const Str &prefix)  { return has_suffixi(str.c_str(), prefix.c_str()); }
 
+namespace std {
+    template<>
+    class hash<Str> {
+    public:
+        size_t operator()(const Str &s) const
+        {
+            // FNV-1a hash
+            size_t hash = 2166136261;
+            for (int i=0; i < s.size(); i++)
+                hash = (hash ^ s[i]) * 16777619;
+            return hash;
+        }
+    };
+}
+
 #endif
\ No newline at end of file
@@ -2,36 +2,137 @@
 #include "common.h"
 #include "util.h"
 #include "str.h"
+#include "bundle.h"
+#include "jobs.h"
+#include "simd.h"
+#include "pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#endif
+
+// ---- file mappings
+
+// files smaller than this just get read; mapping them isn't worth the syscalls
+static const U32 MAP_THRESHOLD = 16*1024;
+
+// Maps a file copy-on-write: callers may scribble over the data (dexor does),
+// which gives them private pages, but the file on disk never changes.
+// Returns 0 if the file doesn't exist or is too small to bother mapping.
+static U8 *map_file_raw(const char *filename, U32 *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    U8 *ptr = 0;
+    *size = GetFileSize(file, NULL);
+    if (*size != INVALID_FILE_SIZE && *size >= MAP_THRESHOLD) {
+        if (HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL)) {
+            ptr = (U8 *)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+        }
+    }
+    CloseHandle(file);
+
+    // readahead hint (PrefetchVirtualMemory is Win8+, so look it up dynamically)
+    typedef BOOL (WINAPI *PrefetchFn)(HANDLE, ULONG_PTR, void *, ULONG);
+    static PrefetchFn prefetch = (PrefetchFn)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+    if (ptr && prefetch) {
+        struct { void *addr; SIZE_T size; } range = { ptr, *size };
+        prefetch(GetCurrentProcess(), 1, &range, 0);
+    }
+    return ptr;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    U8 *ptr = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= MAP_THRESHOLD) {
+        *size = (U32) st.st_size;
+        void *p = mmap(0, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            ptr = (U8 *)p;
+            madvise(ptr, *size, MADV_WILLNEED); // start readahead now
+        }
+    }
+    close(fd);
+    return ptr;
+#endif
+}
+
+static void unmap_file(U8 *ptr, U32 size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap(ptr, size);
+#endif
+}
 
 // ---- slices
 
 struct Buffer
 {
     U8 *data;
-    U32 nrefs;
+    std::atomic<U32> nrefs; // slices get passed between threads
+    U32 mapsize; // nonzero if data points into a file mapping
 
-    Buffer(U32 capacity)
+    Buffer(U8 *data, U32 mapsize)
+        : data(data), mapsize(mapsize)
     {
-        data = new U8[capacity];
         nrefs = 0;
-
-        if (!data)
-            panic("out of memory");
     }
 
     ~Buffer()
     {
-        delete[] data;
+        if (mapsize)
+            unmap_file(data, mapsize);
+    }
+
+    // the data follows the header, in the same pool block
+    static Buffer *create(U32 capacity)
+    {
+        Buffer *b = new(pool_alloc(sizeof(Buffer) + capacity)) Buffer(0, 0);
+        b->data = (U8 *) (b + 1);
+        return b;
+    }
+
+    static Buffer *create_mapped(U8 *mapped, U32 size)
+    {
+        return new(pool_alloc(sizeof(Buffer))) Buffer(mapped, size);
     }
 
     static void ref(Buffer *x)      { if (x) x->nrefs++; }
-    static void unref(Buffer *x)    { if (x && --x->nrefs == 0) delete x; }
+    static void unref(Buffer *x)
+    {
+        if (x && --x->nrefs == 0) {
+            x->~Buffer();
+            pool_free(x);
+        }
+    }
 };
 
 void Slice::fini()
@@ -63,7 +164,14 @@ Slice::~Slice()
 
 Slice Slice::make(U32 nbytes)
 {
-    return Slice(new Buffer(nbytes), nbytes);
+    return Slice(Buffer::create(nbytes), nbytes);
+}
+
+Slice Slice::map_file(const Str &filename)
+{
+    U32 size;
+    U8 *mapped = map_file_raw(filename.c_str(), &size);
+    return mapped ? Slice(Buffer::create_mapped(mapped, size), size) : Slice();
 }
 
 Slice &Slice::operator =(const Slice &x)
@@ -97,7 +205,100 @@ Slice Slice::clone() const
     return s;
 }
 
-// ---- file IO
+// ---- virtual file system
+
+Str normalize_path(const Str &filename)
+{
+    Str path;
+    for (int i=0; i < filename.size(); i++) {
+        char ch = filename[i];
+        if (ch == '\\')
+            ch = '/';
+        if (ch == '/' && (path.empty() || path.back() == '/'))
+            continue; // leading or doubled separators
+        if (ch == '.' && filename[i+1] == '/' && (path.empty() || path.back() == '/')) {
+            i++; // "./"
+            continue;
+        }
+        path.push_back((char) tolower((U8) ch));
+    }
+    return path;
+}
+
+// DOS-era data refers to files in arbitrary case, so we scan the asset
+// directories once and resolve names through a case-folded index.
+static std::unordered_map<Str, Str> s_vfs; // normalized name -> real path
+
+static void vfs_add(const Str &name, const Str &path)
+{
+    s_vfs[normalize_path(name)] = path;
+}
+
+static void vfs_scan(const Str &name, const Str &path)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE find = FindFirstFileA((path + "/*").c_str(), &fd);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        Str entry = fd.cFileName;
+        if (entry == "." || entry == "..")
+            continue;
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            vfs_scan(name + "/" + entry, path + "/" + entry);
+        else
+            vfs_add(name + "/" + entry, path + "/" + entry);
+    } while (FindNextFileA(find, &fd));
+    FindClose(find);
+#else
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return;
+
+    while (struct dirent *de = readdir(dir)) {
+        Str entry = de->d_name;
+        if (entry == "." || entry == "..")
+            continue;
+
+        struct stat st;
+        Str entry_path = path + "/" + entry;
+        if (stat(entry_path.c_str(), &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            vfs_scan(name + "/" + entry, entry_path);
+        else
+            vfs_add(name + "/" + entry, entry_path);
+    }
+    closedir(dir);
+#endif
+}
+
+void vfs_mount(const Str &root, const Str &dir)
+{
+    vfs_scan(dir, (root == ".") ? dir : root + "/" + dir);
+}
+
+Str vfs_resolve(const Str &filename)
+{
+    auto it = s_vfs.find(normalize_path(filename));
+    return (it != s_vfs.end()) ? it->second : filename;
+}
+
+void vfs_list(std::vector<Str> *names, const Str &dir, const char *suffix)
+{
+    Str prefix = normalize_path(dir) + "/";
+    names->clear();
+    for (auto it = s_vfs.begin(); it != s_vfs.end(); ++it)
+        if (has_prefixi(it->first, prefix) && has_suffixi(it->first, suffix))
+            names->push_back(it->first);
+    std::sort(names->begin(), names->end(), [](const Str &a, const Str &b) { return strcmp(a.c_str(), b.c_str()) < 0; });
+}
+
+// ---- file loading
 
 static int fsize(FILE *f)
 {
@@ -108,9 +309,14 @@ static int fsize(FILE *f)
     return sz;
 }
 
-Slice try_read_file(const Str &filename)
+static Slice load_file(const Str &filename)
 {
-    FILE *f = fopen(filename.c_str(), "rb");
+    Str path = vfs_resolve(filename);
+    Slice mapped = Slice::map_file(path);
+    if (mapped)
+        return mapped;
+
+    FILE *f = fopen(path.c_str(), "rb");
     if (!f)
         return Slice();
 
@@ -123,6 +329,196 @@ Slice try_read_file(const Str &filename)
     return s;
 }
 
+static void dexor(U8 *buffer, int nbytes, int *start)
+{
+    if (buffer[0] == 0x0a && buffer[1] == 0x00) // already de-xored
+        *start = 2;
+    else if (buffer[0] == 0x5c) {
+        xor_bytes(buffer, nbytes, buffer[1]);
+        *start = 2;
+    } else
+        *start = 0;
+}
+
+static Slice load_xored(const Str &filename)
+{
+    Slice s = load_file(filename);
+    if (!s || s.len() < 2)
+        return s;
+
+    int start;
+    dexor(&s[0], s.len(), &start);
+    return s(start);
+}
+
+// ---- asset cache
+
+namespace {
+    struct CacheEntry {
+        Slice data;
+        U32 last_use;
+        bool loading;   // some thread is reading this file right now
+        bool prefetched; // read ahead of time and not asked for since
+    };
+}
+
+// everything below is guarded by s_cache_mutex; the loads themselves run unlocked
+static std::mutex s_cache_mutex;
+static std::condition_variable s_cache_loaded;
+static std::unordered_map<Str, CacheEntry> s_cache;
+static U32 s_cache_tick;
+static U32 s_prefetched_bytes;
+static AssetCacheStats s_cache_stats = { 0, 0, 0, 0, 32*1024*1024 };
+
+// prefetched files only ever push out other prefetched files, and all of
+// them together get this share of the budget
+static const U32 PREFETCH_SHARE = 4; // 1/4
+
+// xored files are cached post-decode under their own key
+static Str cache_key(const Str &filename, bool xored)
+{
+    return xored ? "xor:" + normalize_path(filename) : normalize_path(filename);
+}
+
+static void cache_erase(std::unordered_map<Str, CacheEntry>::iterator it)
+{
+    s_cache_stats.bytes -= it->second.data.len();
+    if (it->second.prefetched)
+        s_prefetched_bytes -= it->second.data.len();
+    s_cache.erase(it);
+}
+
+static void cache_evict(const Str &key)
+{
+    auto it = s_cache.find(key);
+    if (it != s_cache.end() && !it->second.loading)
+        cache_erase(it);
+}
+
+static bool cache_evict_lru(bool prefetched_only=false)
+{
+    auto lru = s_cache.end();
+    for (auto it = s_cache.begin(); it != s_cache.end(); ++it)
+        if (!it->second.loading && (!prefetched_only || it->second.prefetched) &&
+            (lru == s_cache.end() || it->second.last_use < lru->second.last_use))
+            lru = it;
+
+    if (lru == s_cache.end())
+        return false;
+
+    s_cache_stats.evictions++;
+    cache_erase(lru);
+    return true;
+}
+
+// makes room for nbytes more; false if a prefetch doesn't fit
+static bool cache_make_room(U32 nbytes, bool prefetch)
+{
+    if (!prefetch) {
+        // evicting only drops our reference; slices handed out earlier stay valid
+        while (s_cache_stats.bytes + nbytes > s_cache_stats.budget && cache_evict_lru()) {
+        }
+        return true;
+    }
+
+    U32 share = s_cache_stats.budget / PREFETCH_SHARE;
+    while ((s_prefetched_bytes + nbytes > share || s_cache_stats.bytes + nbytes > s_cache_stats.budget) &&
+        cache_evict_lru(true)) {
+    }
+    return s_prefetched_bytes + nbytes <= share && s_cache_stats.bytes + nbytes <= s_cache_stats.budget;
+}
+
+static Slice cached_load(const Str &filename, bool xored, bool prefetch=false)
+{
+    Str key = cache_key(filename, xored);
+    std::unique_lock<std::mutex> lock(s_cache_mutex);
+
+    // if another thread is already loading this file, wait for it
+    auto it = s_cache.find(key);
+    while (it != s_cache.end() && it->second.loading) {
+        s_cache_loaded.wait(lock);
+        it = s_cache.find(key);
+    }
+
+    if (it != s_cache.end()) {
+        if (prefetch)
+            return it->second.data;
+
+        CacheEntry &e = it->second;
+        if (e.prefetched) {
+            e.prefetched = false;
+            s_prefetched_bytes -= e.data.len();
+        }
+        s_cache_stats.hits++;
+        e.last_use = ++s_cache_tick;
+        return e.data;
+    }
+
+    s_cache_stats.misses++;
+    s_cache[key].loading = true;
+
+    lock.unlock();
+    Slice s = xored ? load_xored(filename) : load_file(filename);
+    lock.lock();
+
+    s_cache.erase(key);
+    if (s && s.len() <= s_cache_stats.budget && cache_make_room(s.len(), prefetch)) {
+        CacheEntry &e = s_cache[key];
+        e.data = s;
+        e.last_use = ++s_cache_tick;
+        e.loading = false;
+        e.prefetched = prefetch;
+        s_cache_stats.bytes += s.len();
+        if (prefetch)
+            s_prefetched_bytes += s.len();
+    }
+
+    s_cache_loaded.notify_all();
+    return s;
+}
+
+void asset_cache_set_budget(U32 nbytes)
+{
+    std::lock_guard<std::mutex> lock(s_cache_mutex);
+    s_cache_stats.budget = nbytes;
+    while (s_cache_stats.bytes > nbytes && cache_evict_lru()) {
+    }
+}
+
+void asset_cache_flush()
+{
+    std::lock_guard<std::mutex> lock(s_cache_mutex);
+    while (cache_evict_lru()) {
+    }
+}
+
+AssetCacheStats asset_cache_get_stats()
+{
+    std::lock_guard<std::mutex> lock(s_cache_mutex);
+    return s_cache_stats;
+}
+
+void asset_cache_dump_stats()
+{
+    std::lock_guard<std::mutex> lock(s_cache_mutex);
+    const AssetCacheStats &st = s_cache_stats;
+    printf("asset cache: %u hits, %u misses, %u evictions, %u/%u bytes in %u files\n",
+        st.hits, st.misses, st.evictions, st.bytes, st.budget, (U32) s_cache.size());
+}
+
+// ---- file IO
+
+Slice try_read_file(const Str &filename)
+{
+    Slice s = bundle_find_file(filename);
+    return s ? s : cached_load(filename, false);
+}
+
+Slice try_read_file_uncached(const Str &filename)
+{
+    return load_file(filename);
+}
+
 Slice read_file(const Str &filename)
 {
     Slice s = try_read_file(filename.c_str());
@@ -133,37 +529,31 @@ Slice read_file(const Str &filename)
 
 void write_file(const Str &filename, const void *buf, int size)
 {
-    FILE *f = fopen(filename.c_str(), "wb");
+    {
+        std::lock_guard<std::mutex> lock(s_cache_mutex);
+        cache_evict(cache_key(filename, false));
+        cache_evict(cache_key(filename, true));
+    }
+
+    Str path = vfs_resolve(filename);
+    FILE *f = fopen(path.c_str(), "wb");
     if (!f)
         panic("couldn't open %s for writing", filename.c_str());
+    vfs_add(filename, path);
 
     fwrite(buf, size, 1, f);
     fclose(f);
 }
 
-static void dexor(U8 *buffer, int nbytes, int *start)
+Slice try_read_xored(const Str &filename)
 {
-    if (buffer[0] == 0x0a && buffer[1] == 0x00) // already de-xored
-        *start = 2;
-    else if (buffer[0] == 0x5c) {
-        U8 key = buffer[1];
-        for (int i=0; i < nbytes; i++)
-            buffer[i] ^= key;
-
-        *start = 2;
-    } else
-        *start = 0;
+    Slice s = bundle_find_xored(filename);
+    return s ? s : cached_load(filename, true);
 }
 
-Slice try_read_xored(const Str &filename)
+bool is_xored_file(const Str &filename)
 {
-    Slice s = try_read_file(filename);
-    if (!s || s.len() < 2)
-        return s;
-
-    int start;
-    dexor(&s[0], s.len(), &start);
-    return s(start);
+    return has_suffixi(filename, ".par") || has_suffixi(filename, ".cm") || has_suffixi(filename, ".vb");
 }
 
 Slice read_xored(const Str &filename)
@@ -174,6 +564,39 @@ Slice read_xored(const Str &filename)
     return s;
 }
 
+// ---- batch loading
+
+void read_files_batch(const std::vector<Str> &filenames, std::vector<Slice> *out)
+{
+    std::vector<Slice> results(filenames.size());
+    {
+        JobGroup jobs;
+        for (size_t i=0; i < filenames.size(); i++) {
+            const Str *name = &filenames[i];
+            Slice *result = &results[i];
+            jobs.run([name, result] { *result = is_xored_file(*name) ? try_read_xored(*name) : try_read_file(*name); });
+        }
+    } // waits for all reads
+
+    if (out)
+        out->swap(results);
+}
+
+static JobGroup s_prefetch_jobs(true); // never ahead of loads someone is waiting for
+
+void prefetch_files(const std::vector<Str> &filenames)
+{
+    for (size_t i=0; i < filenames.size(); i++) {
+        Str name = filenames[i];
+        bool xored = is_xored_file(name);
+        s_prefetch_jobs.run([name, xored] {
+            Slice bundled = xored ? bundle_find_xored(name) : bundle_find_file(name);
+            if (!bundled)
+                cached_load(name, xored, true);
+        });
+    }
+}
+
 // ---- decoding helpers
 
 int little_u16(const U8 *p)
@@ -202,48 +625,131 @@ void print_hex(const Str &desc, const Slice &what, int bytes_per_line)
     }
 }
 
-void list_gra_contents(const Slice &grafile)
+// ---- .gra archives
+
+static Str gra_key(const Str &name)
+{
+    Str key = name;
+    for (int i=0; i < key.size(); i++)
+        key[i] = (char) toupper((U8) key[i]);
+    return key;
+}
+
+GraArchive::GraArchive()
 {
-    int dir_size = little_u16(&grafile[0]);
-    int pos = 2;
-    while (pos < dir_size) {
-        int len = 0;
-        while (grafile[pos+len] >= ' ')
-            len++;
-        U8 type = grafile[pos+len];
-        printf("  %.*s type=%d\n", len, &grafile[pos], type);
-        pos += len + 1 + 4;
-    }
 }
 
-int find_gra_item(const Slice &grafile, const Str &name, U8 *type)
+GraArchive::GraArchive(const Slice &grafile, const Str &filename)
+    : path(filename), file(grafile)
 {
-    int dir_size = little_u16(&grafile[0]);
-    int pos = 2;
+    if (file.len() < 2 || little_u16(&file[0]) > file.len())
+        panic("%s: corrupt .gra directory", path.c_str());
+
+    U32 dir_size = little_u16(&file[0]);
+    U32 pos = 2;
     while (pos < dir_size) {
-        int len = 0, matchlen = 0;
-        while (grafile[pos+len] >= ' ') {
-            if (name[matchlen] &&
-                toupper(grafile[pos+len]) == toupper((U8)name[matchlen]))
-                matchlen++;
+        U32 len = 0;
+        while (pos+len < dir_size && file[pos+len] >= ' ')
             len++;
-        }
-        pos += len;
+        if (pos + len + 5 > dir_size)
+            panic("%s: corrupt .gra directory", path.c_str());
 
-        if (len == matchlen && !name[matchlen]) { // found our file
-            *type = grafile[pos];
-            int offs = little_u16(&grafile[pos + 1]);
-            int seg = little_u16(&grafile[pos + 3]);
-            return dir_size + (seg << 4) + offs;
-        }
+        Item item;
+        item.name = Str((const char *)&file[pos], (const char *)&file[pos+len]);
+        pos += len;
 
-        // no match, continue looking
+        item.type = file[pos];
+        int offs = little_u16(&file[pos + 1]);
+        int seg = little_u16(&file[pos + 3]);
+        item.offs = dir_size + (seg << 4) + offs;
+        item.size = 0;
         pos += 1 + 4;
+        if (item.offs > file.len())
+            panic("%s: item %s starts past the end of the file", path.c_str(), item.name.c_str());
+
+        index.insert(std::make_pair(gra_key(item.name), (int) items.size())); // first one wins
+        items.push_back(item);
+    }
+
+    // items are stored back to back, so each one ends where the next one
+    // starts; the last one ends at the end of the file
+    std::vector<U32> starts;
+    for (auto it = items.begin(); it != items.end(); ++it)
+        starts.push_back(it->offs);
+    std::sort(starts.begin(), starts.end());
+
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        auto next = std::upper_bound(starts.begin(), starts.end(), it->offs);
+        U32 end = (next != starts.end()) ? *next : file.len();
+        it->size = end - it->offs;
+    }
+}
+
+const GraArchive::Item *GraArchive::find(const Str &name) const
+{
+    auto it = index.find(gra_key(name));
+    return (it != index.end()) ? &items[it->second] : 0;
+}
+
+static const size_t GRA_KEEP_RECENT = 8;
+static std::unordered_map<Str, std::weak_ptr<const GraArchive> > s_gra_archives;
+static std::deque<std::shared_ptr<const GraArchive> > s_gra_recent; // most recent first
+static std::mutex s_gra_mutex;
+
+// keeps gra alive while it's among the last few asked for (s_gra_mutex must be held)
+static void gra_touch(const std::shared_ptr<const GraArchive> &gra)
+{
+    auto it = std::find(s_gra_recent.begin(), s_gra_recent.end(), gra);
+    if (it != s_gra_recent.end())
+        s_gra_recent.erase(it);
+    s_gra_recent.push_front(gra);
+    if (s_gra_recent.size() > GRA_KEEP_RECENT)
+        s_gra_recent.pop_back();
+}
+
+std::shared_ptr<const GraArchive> read_gra(const Str &filename)
+{
+    Str key = normalize_path(filename);
+    {
+        std::lock_guard<std::mutex> lock(s_gra_mutex);
+        auto it = s_gra_archives.find(key);
+        if (it != s_gra_archives.end()) {
+            std::shared_ptr<const GraArchive> gra = it->second.lock();
+            if (gra) {
+                gra_touch(gra);
+                return gra;
+            }
+        }
     }
 
-    return -1;
+    // load outside the lock; if another thread beat us to it, keep theirs
+    std::shared_ptr<const GraArchive> gra = std::make_shared<GraArchive>(read_file(filename), key);
+    std::lock_guard<std::mutex> lock(s_gra_mutex);
+    std::weak_ptr<const GraArchive> &slot = s_gra_archives[key];
+    std::shared_ptr<const GraArchive> theirs = slot.lock();
+    if (theirs)
+        gra = theirs;
+    else
+        slot = gra;
+    gra_touch(gra);
+    return gra;
 }
 
+void gra_shutdown()
+{
+    std::lock_guard<std::mutex> lock(s_gra_mutex);
+    s_gra_recent.clear();
+    s_gra_archives.clear();
+}
+
+void list_gra_contents(const GraArchive &gra)
+{
+    for (auto it = gra.begin(); it != gra.end(); ++it)
+        printf("  %s type=%d size=%d\n", it->name.c_str(), it->type, it->size);
+}
+
+// ---- slice helpers
+
 Str to_string(const Slice &sl)
 {
     Slice &s = (Slice &)sl;
@@ -269,25 +775,18 @@ Slice chop_until(Slice &from, U8 sep)
     return s;
 }
 
-static bool islinespace(U8 ch)
-{
-    return ch == '\r' || ch == '\n';
-}
-
 Slice chop_line(Slice &buf)
 {
-    // find end of this line
-    U32 pos = 0;
-    while (pos < buf.len() && !islinespace(buf[pos]))
-        pos++;
-    Slice line = buf(0, pos);
+    const U8 *start = &buf[0], *end = start + buf.len();
 
-    // find LF to find start of next line
-    while (pos < buf.len() && buf[pos] != '\n')
-        pos++;
-    if (pos < buf.len())
-        pos++;
-    buf = buf(pos);
+    // the line ends at the first CR or LF; the next one starts after the LF
+    const U8 *eol = find_any_byte(start, end, "\r\n");
+    const U8 *next = (eol < end && *eol == '\r') ? find_byte(eol, end, '\n') : eol;
+    Slice line = buf(0, (U32) (eol - start));
+
+    if (next < end)
+        next++;
+    buf = buf((U32) (next - start));
 
     return line;
 }
@@ -316,3 +815,183 @@ int scan_int(Slice &buf)
     buf = buf(pos);
     return val * sign;
 }
+
+// ---- scanning benchmark
+
+static double bench_seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double) now.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// the byte-at-a-time loops the kernels replaced
+static void xor_bytes_plain(U8 *p, U32 n, U8 key)
+{
+    for (U32 i=0; i < n; i++)
+        p[i] ^= key;
+}
+
+static U32 find_any_plain(const U8 *p, U32 n, const char *set)
+{
+    U32 pos = 0;
+    while (pos < n && !strchr(set, p[pos]))
+        pos++;
+    return pos;
+}
+
+static bool equal_nocase_plain(const U8 *a, const U8 *b, U32 n)
+{
+    for (U32 i=0; i < n; i++)
+        if (tolower(a[i]) != tolower(b[i]))
+            return false;
+    return true;
+}
+
+static Slice chop_line_plain(Slice &buf)
+{
+    U32 eol = find_any_plain(&buf[0], buf.len(), "\r\n");
+    U32 next = eol;
+    while (next < buf.len() && buf[next] != '\n')
+        next++;
+    if (next < buf.len())
+        next++;
+
+    Slice line = buf(0, eol);
+    buf = buf(next);
+    return line;
+}
+
+// runs fn for a quarter second; MB/s through it, and what it last returned
+template<class Fn> static double bench_rate(U32 bytes, Fn fn, U32 *result)
+{
+    U32 reps = 0;
+    double start = bench_seconds(), elapsed;
+    do {
+        *result = fn();
+        reps++;
+    } while ((elapsed = bench_seconds() - start) < 0.25);
+    return bytes * (double) reps / elapsed / (1024*1024);
+}
+
+template<class Fn> static void bench_report(const char *what, U32 bytes, Fn fn)
+{
+    U32 plain_result, kernel_result;
+    double plain = bench_rate(bytes, [&] { return fn(false); }, &plain_result);
+    double kernel = bench_rate(bytes, [&] { return fn(true); }, &kernel_result);
+    if (plain_result != kernel_result)
+        panic("%s: kernel and plain loop disagree (%u vs %u)", what, kernel_result, plain_result);
+    printf("%-8s %9.1f MB/s %9.1f MB/s %6.2fx\n", what, plain, kernel, kernel / plain);
+}
+
+void scan_benchmark()
+{
+    static const char *suffixes[] = { ".par", ".cm", ".vb" };
+    std::vector<Str> names;
+    for (int i=0; i < ARRAY_COUNT(suffixes); i++) {
+        std::vector<Str> some;
+        vfs_list(&some, "data", suffixes[i]);
+        names.insert(names.end(), some.begin(), some.end());
+    }
+
+    // private copies: raw ones to de-xor over and over, and the text
+    std::vector<Slice> raw, text;
+    std::vector<U8> keys;
+    U32 raw_bytes = 0, text_bytes = 0;
+    for (size_t i=0; i < names.size(); i++) {
+        Slice s = try_read_file_uncached(names[i]);
+        if (s.len() < 2)
+            continue;
+
+        Slice copy = Slice::make(s.len());
+        memcpy(&copy[0], &s[0], s.len());
+        int start;
+        keys.push_back(copy[0] == 0x5c ? copy[1] : 0);
+        raw.push_back(copy);
+        raw_bytes += copy.len();
+
+        Slice plain = Slice::make(s.len());
+        memcpy(&plain[0], &s[0], s.len());
+        dexor(&plain[0], plain.len(), &start);
+        text.push_back(plain(start));
+        text_bytes += plain.len() - start;
+    }
+    if (raw.empty())
+        panic("no scripts under data/");
+
+    // and every line upper-cased, for the case-insensitive compares
+    std::vector<Slice> lines, upper;
+    for (size_t i=0; i < text.size(); i++) {
+        Slice buf = text[i];
+        while (buf.len()) {
+            Slice line = chop_line(buf);
+            Slice up = Slice::make(line.len());
+            for (U32 j=0; j < line.len(); j++)
+                up[j] = (U8) toupper(line[j]);
+            lines.push_back(line);
+            upper.push_back(up);
+        }
+    }
+
+    printf("%d scripts, %u bytes, %d lines\n", (int) raw.size(), text_bytes, (int) lines.size());
+    printf("%-8s %14s %14s\n", "", "plain", "kernel");
+
+    bench_report("dexor", raw_bytes, [&](bool kernel) -> U32 {
+        U32 sum = 0;
+        for (size_t i=0; i < raw.size(); i++) {
+            U8 *p = &raw[i][0];
+            U32 n = raw[i].len();
+            for (int pass=0; pass < 2; pass++) { // the second one puts it back
+                if (kernel)
+                    xor_bytes(p, n, keys[i]);
+                else
+                    xor_bytes_plain(p, n, keys[i]);
+                sum += p[n - 1];
+            }
+        }
+        return sum;
+    });
+
+    bench_report("lines", text_bytes, [&](bool kernel) -> U32 {
+        U32 sum = 0;
+        for (size_t i=0; i < text.size(); i++) {
+            Slice buf = text[i];
+            while (buf.len())
+                sum += 1 + (kernel ? chop_line(buf) : chop_line_plain(buf)).len();
+        }
+        return sum;
+    });
+
+    bench_report("words", text_bytes, [&](bool kernel) -> U32 {
+        U32 words = 0;
+        for (size_t i=0; i < lines.size(); i++) {
+            const U8 *p = lines[i].len() ? &lines[i][0] : 0;
+            U32 pos = 0, n = lines[i].len();
+            while (pos < n) {
+                pos += kernel ? (U32) (find_any_byte(p + pos, p + n, " ;") - (p + pos)) : find_any_plain(p + pos, n - pos, " ;");
+                words++;
+                pos++;
+            }
+        }
+        return words;
+    });
+
+    bench_report("nocase", text_bytes, [&](bool kernel) -> U32 {
+        U32 equal = 0;
+        for (size_t i=0; i < lines.size(); i++) {
+            U32 n = lines[i].len();
+            if (!n)
+                continue;
+            if (kernel ? equal_nocase(&lines[i][0], &upper[i][0], n) : equal_nocase_plain(&lines[i][0], &upper[i][0], n))
+                equal++;
+        }
+        return equal;
+    });
+}
@@ -2,8 +2,11 @@
 #define __UTIL_H__
 
 #include "common.h"
+#include "str.h"
+#include <vector>
+#include <unordered_map>
+#include <memory>
 
-class Str;
 struct Buffer;
 
 class Slice {
@@ -23,6 +26,7 @@ public:
     ~Slice();
 
     static Slice make(U32 nbytes);
+    static Slice map_file(const Str &filename); // copy-on-write mapping; empty if file missing or small
 
     Slice &operator =(const Slice& x);
     Slice &operator =(Slice &&x)        { if (this != &x) { fini(); move_from(x); } return *this; }
@@ -40,17 +44,82 @@ public:
     U32 len() const                     { return length; }
 };
 
+// All reads go through a shared cache: repeated reads of the same file
+// hand out the same (refcounted) data, so don't modify it in place!
+struct AssetCacheStats {
+    U32 hits, misses, evictions;
+    U32 bytes, budget;
+};
+
+void asset_cache_set_budget(U32 nbytes); // evicts LRU files down to nbytes; 0 disables caching
+void asset_cache_flush();
+AssetCacheStats asset_cache_get_stats();
+void asset_cache_dump_stats(); // debug
+
+Str normalize_path(const Str &filename); // lower case, forward slashes
+
+// Case-insensitive file name resolution for everything below. vfs_mount scans
+// root/dir once; files from later mounts override earlier ones (overlays).
+void vfs_mount(const Str &root, const Str &dir);
+Str vfs_resolve(const Str &filename); // returns filename itself if not indexed
+void vfs_list(std::vector<Str> *names, const Str &dir, const char *suffix); // sorted, normalized
+
+bool is_xored_file(const Str &filename); // .par, .cm and .vb are stored xored
+
 Slice try_read_file(const Str &filename);
+Slice try_read_file_uncached(const Str &filename); // skips bundle and asset cache
 Slice read_file(const Str &filename);
 void write_file(const Str &filename, const void *buf, int size);
 Slice try_read_xored(const Str &filename);
 Slice read_xored(const Str &filename);
 
+// Batch loading: reads files in parallel on the worker threads. Results also
+// land in the asset cache, so later read_file/read_xored calls for them are
+// hits. Xored files come back decoded, as read_xored returns them.
+void read_files_batch(const std::vector<Str> &filenames, std::vector<Slice> *out=0); // blocks
+void prefetch_files(const std::vector<Str> &filenames); // returns immediately; dexors xored files; takes at most 1/4 of the cache budget
+
 int little_u16(const U8 *p);
 
 void print_hex(const Str &name, const Slice &what, int bytes_per_line=16);
-void list_gra_contents(const Slice &grafile); // for debugging
-int find_gra_item(const Slice &grafile, const Str &name, U8 *type);
+
+// .gra archives: directory gets parsed once into a case-insensitive index
+class GraArchive {
+public:
+    struct Item {
+        Str name;           // as stored in the directory
+        U8 type;            // 5=delta, 8=RLE
+        U32 offs, size;     // location of data in file
+    };
+
+    typedef std::vector<Item>::const_iterator iterator;
+
+    GraArchive();
+    explicit GraArchive(const Slice &grafile, const Str &filename=Str());
+
+    const Str &filename() const             { return path; }
+
+    const Item *find(const Str &name) const; // 0 if not found
+    Slice data(const Item *item) const      { return file(item->offs, item->offs + item->size); }
+
+    // iterates in directory order
+    iterator begin() const                  { return items.begin(); }
+    iterator end() const                    { return items.end(); }
+
+private:
+    Str path;
+    Slice file;
+    std::vector<Item> items;
+    std::unordered_map<Str, int> index;     // upper-case name -> item
+};
+
+// Parsed once and shared for as long as anyone holds on to it or it's among
+// the last 8 asked for; after that the asset cache decides how long the file
+// stays around. Panics if the directory is corrupt. Any thread.
+std::shared_ptr<const GraArchive> read_gra(const Str &filename);
+void gra_shutdown(); // lets go of the recent ones
+
+void list_gra_contents(const GraArchive &gra); // for debugging
 
 Str to_string(const Slice &sl);
 
@@ -60,4 +129,6 @@ Slice chop_line(Slice &scan_buf); // returns first line, slices it off scan_buf
 Slice eat_heading_space(Slice text); // eats any white space characters at start
 int scan_int(Slice &scan_buf);
 
+void scan_benchmark(); // times the scanning kernels against plain loops on the scripts in data/ and prints the rates
+
 #endif
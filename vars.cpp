@@ -5,21 +5,6 @@
 #include <ctype.h>
 #include <unordered_map>
 
-namespace std {
-    template<>
-    class hash<Str> {
-    public:
-        size_t operator()(const Str &s) const
-        {
-            // FNV-1a hash
-            size_t hash = 2166136261;
-            for (int i=0; i < s.size(); i++)
-                hash = (hash ^ s[i]) * 16777619;
-            return hash;
-        }
-    };
-}
-
 static std::unordered_map<Str, int> int_vars;
 static std::unordered_map<Str, Str> str_vars;
 